@@ -1,23 +1,139 @@
+"""
+Streaming diet anomaly detection.
+
+Every meal (grams eaten) updates per-pet state of constant size: an EWMA of
+meal size and its variance, plus an EWMA per hour of day so that a small
+breakfast is not compared against a large dinner. A meal more than
+`threshold` (20%) away from its baseline and more than `z` deviations out is
+reported as eating too much or too little.
+
+State for the whole fleet lives in numpy arrays indexed by pet, so history
+can be backfilled for every pet at once with vectorized updates. The
+scheduler's registry backfills the meals in its telemetry store at startup
+and then updates the detector at every meal (server/src/registry.py).
+"""
+
 import numpy as np
 import sys
 
+TOO_MUCH = "Pet eats too much"
+TOO_LITTLE = "Pet eats too less"
+NORMAL = "Diet is normal"
 
-if __name__ == '__main__':
 
-    with open('weight.csv', 'r') as f:
-        data = [float(x) for x in f.readline().split(", ")]
+class DietDetector:
+
+    def __init__(self, alpha=0.1, hour_alpha=0.3, threshold=0.2, z=2.0, warmup=3, capacity=16):
+        self.alpha = alpha
+        self.hour_alpha = hour_alpha
+        self.threshold = threshold
+        self.z = z
+        self.warmup = warmup
+        self.pets = {}
+        self.mean = np.zeros(capacity)
+        self.var = np.zeros(capacity)
+        self.count = np.zeros(capacity, dtype=np.int64)
+        self.hour_mean = np.zeros((capacity, 24))
+        self.hour_count = np.zeros((capacity, 24), dtype=np.int64)
+
+    def index(self, pet):
+        idx = self.pets.get(pet)
+        if idx is None:
+            idx = self.pets[pet] = len(self.pets)
+            if idx >= len(self.mean):
+                grow = len(self.mean)
+                self.mean = np.concatenate([self.mean, np.zeros(grow)])
+                self.var = np.concatenate([self.var, np.zeros(grow)])
+                self.count = np.concatenate([self.count, np.zeros(grow, dtype=np.int64)])
+                self.hour_mean = np.concatenate([self.hour_mean, np.zeros((grow, 24))])
+                self.hour_count = np.concatenate([self.hour_count, np.zeros((grow, 24), dtype=np.int64)])
+        return idx
+
+    def _classify(self, idx, hour, grams):
+        # Returns -1, 0 or 1 for too little, normal and too much
+        hourly = self.hour_count[idx, hour] >= self.warmup
+        baseline = np.where(hourly, self.hour_mean[idx, hour], self.mean[idx])
+        std = np.sqrt(self.var[idx])
+        diff = grams - baseline
+        ready = (self.count[idx] >= self.warmup) & (baseline > 0)
+        rel = np.divide(diff, baseline, out=np.zeros_like(diff, dtype=float), where=baseline > 0)
+        out = (np.abs(diff) > self.z * std) & ready
+        return np.where(out & (rel > self.threshold), 1, np.where(out & (rel < -self.threshold), -1, 0))
+
+    def _update(self, idx, hour, grams):
+        first = self.count[idx] == 0
+        alpha = np.where(first, 1.0, self.alpha)
+        diff = grams - self.mean[idx]
+        self.mean[idx] += alpha * diff
+        self.var[idx] = np.where(first, 0.0, (1 - alpha) * (self.var[idx] + alpha * diff * diff))
+        self.count[idx] += 1
+        first = self.hour_count[idx, hour] == 0
+        alpha = np.where(first, 1.0, self.hour_alpha)
+        self.hour_mean[idx, hour] += alpha * (grams - self.hour_mean[idx, hour])
+        self.hour_count[idx, hour] += 1
+
+    def update(self, pet, t, grams):
+        """Feed one meal; t is epoch seconds. Returns the diet message."""
+        idx = np.array([self.index(pet)])
+        hour = np.array([int(t // 3600) % 24])
+        grams = np.array([float(grams)])
+        verdict = self._classify(idx, hour, grams)[0]
+        self._update(idx, hour, grams)
+        return TOO_MUCH if verdict > 0 else TOO_LITTLE if verdict < 0 else NORMAL
 
-    average = np.mean(data)
-    new_entry=int(sys.argv[1])
+    def backfill(self, pets, times, grams):
+        """Feed a batch of meals for many pets, in time order per pet.
 
-    diff =new_entry-average
+        Returns the verdict (-1, 0, 1) of every meal. Meals are processed in
+        rounds, one meal per pet per round, each round fully vectorized.
+        """
+        idx = np.array([self.index(p) for p in pets], dtype=np.int64)
+        hours = (np.asarray(times, dtype=np.int64) // 3600) % 24
+        grams = np.asarray(grams, dtype=float)
+        order = np.lexsort((np.asarray(times), idx))
+        # rank of each meal among the meals of the same pet
+        sorted_idx = idx[order]
+        starts = np.r_[0, np.flatnonzero(np.diff(sorted_idx)) + 1]
+        rank = np.arange(len(order)) - np.repeat(starts, np.diff(np.r_[starts, len(order)]))
+        verdicts = np.zeros(len(idx), dtype=np.int64)
+        for r in range(rank.max() + 1 if len(rank) else 0):
+            sel = order[rank == r]
+            verdicts[sel] = self._classify(idx[sel], hours[sel], grams[sel])
+            self._update(idx[sel], hours[sel], grams[sel])
+        return verdicts
 
-    if diff/average > 0.2:
-        print("Pet eats too much")
-    elif diff / average < -0.2:
-        print("Pet eats too less")
-    else:
-        print("Diet is normal")
-        data.append(new_entry)
-        
 
+def bench(num_pets, meals):
+    import time
+    rng = np.random.default_rng(0)
+    pets = np.repeat(np.arange(num_pets), meals)
+    times = np.tile(np.arange(meals) * 8 * 3600, num_pets)
+    grams = rng.normal(60, 6, num_pets * meals)
+
+    det = DietDetector(capacity=num_pets)
+    start = time.perf_counter()
+    det.backfill(pets, times, grams)
+    batch = time.perf_counter() - start
+    print("backfill: {} meals for {} pets in {:.2f} s, {:.0f} meals/s".format(len(grams), num_pets, batch, len(grams) / batch))
+
+    start = time.perf_counter()
+    n = min(len(grams), 100000)
+    for i in range(n):
+        det.update(int(pets[i]), int(times[i]) + meals * 8 * 3600, grams[i])
+    stream = time.perf_counter() - start
+    print("streaming: {} meals in {:.2f} s, {:.0f} meals/s".format(n, stream, n / stream))
+
+
+if __name__ == '__main__':
+
+    if sys.argv[1] == '--bench':
+        bench(int(sys.argv[2]) if len(sys.argv) > 2 else 10000, 90)
+        sys.exit(0)
+
+    with open('weight.csv', 'r') as f:
+        data = [float(x) for x in f.readline().split(", ")]
+
+    # history has no timestamps, treat it as one meal a day at the same hour
+    detector = DietDetector()
+    detector.backfill(np.zeros(len(data)), np.arange(len(data)) * 86400, data)
+    print(detector.update(0, len(data) * 86400, int(sys.argv[1])))
@@ -1,49 +1,189 @@
 """
-The script running on raspberry pi to take a picture and
-1) do facial recognition locally or
-2) send to cloud for processing
+Capture daemon running on the raspberry pi next to the feeder.
 
+The camera is opened once and kept running so a capture does not pay for
+sensor start-up and exposure settling. When a feeder reports motion on
+pet-feeder/<device id>/motion a short burst is grabbed from the video port
+as raw YUV into a preallocated ring of buffers; the Y plane of each buffer
+is a numpy view handed straight to the recognizer, with no JPEG encode and
+decode in between. The best match per pet over the burst is published to
+pet-feeder/<device id>/identity as
+	{"pets": [{"name": "Cat1", "conf": 0.93}], "motion": <epoch s>, "ms": {...}}
+where "motion" is the time the feeder stamped on the motion report, so the
+latency budget covers the hop from the feeder as well ("uplink" in "ms").
+Reports from a feeder without a synced clock are timed from their arrival.
+
+Run from automated_functions:
+	python camera.py
+	python camera.py -b localhost:1883 -r data    # local broker, recorded pictures
 """
 
-from picamera import PiCamera
-import datetime
-from time import sleep
+from queue import Queue, Full
+import json
+import os
+import sys
+import threading
+import time
+
+import numpy as np
 from AWSIoTPythonSDK.MQTTLib import AWSIoTMQTTClient
 
-camera = PiCamera()
-camera.resolution = (2592, 1944)
+from face_detection.frontend import FrontEnd
+from face_recogniction.recognizer import Recognizer
 
 root_cert = '../aws-auth/AmazonRootCA1.pem'
 private_key = '../aws-auth/951ad5141e-private.pem.key'
 cert = '../aws-auth/951ad5141e-certificate.pem.crt'
 
-def sub_cb(self):
-	camera.start_preview()
-	sleep(1)
-	camera.capture('/home/pi/Desktop/gx_folder/image.jpg')
-	camera.stop_preview()
-	aws_client.publish(self.pub_topic, "message_received", 0)
+# 2x2 binned sensor mode: full field of view, fast from the video port.
+# The detection front-end works at 640 px wide anyway.
+resolution = (1296, 972)
+burst_len = 3
+ring_len = 2 * burst_len
+
+
+class FrameBuffer:
+	# Preallocated YUV420 frame that picamera writes into
+
+	def __init__(self, width, height):
+		# picamera pads raw frames to 32 x 16 pixel multiples
+		fwidth = (width + 31) // 32 * 32
+		fheight = (height + 15) // 16 * 16
+		self.data = np.empty(fwidth * fheight * 3 // 2, dtype=np.uint8)
+		self.y = self.data[:fwidth * fheight].reshape(fheight, fwidth)[:height, :width]
+		self.pos = 0
+
+	def write(self, buf):
+		n = len(buf)
+		self.data[self.pos:self.pos + n] = np.frombuffer(buf, dtype=np.uint8)
+		self.pos += n
+		return n
+
+	def flush(self):
+		pass
+
+
+class PiCameraSource:
+
+	def __init__(self):
+		from picamera import PiCamera
+		self.camera = PiCamera(resolution=resolution, framerate=30)
+		self.ring = [FrameBuffer(*resolution) for _ in range(ring_len)]
+		self.next = 0
+		# let gain and white balance settle once, not on every capture
+		time.sleep(2)
+
+	def burst(self, n):
+		frames = [self.ring[(self.next + i) % ring_len] for i in range(n)]
+		self.next = (self.next + n) % ring_len
+		for frame in frames:
+			frame.pos = 0
+		self.camera.capture_sequence(frames, format='yuv', use_video_port=True)
+		return [frame.y for frame in frames]
+
+
+class ReplaySource:
+	# Recorded pictures instead of the camera, for running without a pi
+
+	def __init__(self, path):
+		import cv2
+		self.frames = [cv2.imread(os.path.join(path, name), cv2.IMREAD_GRAYSCALE)
+		               for name in sorted(os.listdir(path)) if name.lower().endswith(('.jpg', '.jpeg', '.png'))]
+		self.next = 0
+
+	def burst(self, n):
+		# the same picture n times, like a burst of a pet sitting still
+		frame = self.frames[self.next]
+		self.next = (self.next + 1) % len(self.frames)
+		return [frame] * n
+
 
+class CaptureDaemon:
 
-ip_addr='a2ot5vs3yt7xtc-ats.iot.us-west-2.amazonaws.com'
-port=8883
-aws_client = AWSIoTMQTTClient("motion")
-aws_client.configureEndpoint(ip_addr, port)
-aws_client.configureCredentials(root_cert, private_key, cert)
+	def __init__(self, client, source, recognizer):
+		self.client = client
+		self.source = source
+		self.recognizer = recognizer
+		# at most one pending burst per device; more motion while it waits adds nothing
+		self.pending = set()
+		self.lock = threading.Lock()
+		self.queue = Queue(maxsize=16)
 
-aws_client.configureAutoReconnectBackoffTime(1, 32, 20)
-aws_client.configureOfflinePublishQueueing(-1)  # Infinite offline Publish queueing
-aws_client.configureDrainingFrequency(2)  # Draining: 2 Hz
-aws_client.configureConnectDisconnectTimeout(10)  # 10 sec
-aws_client.configureMQTTOperationTimeout(5)  # 5 sec
-aws_client.connect()
-sub_topic = "pet-feeder/motion"
-pub_topic = "pet-feeder/test"
-aws_client.subscribe(sub_topic, 1, sub_cb)
+	def sub_cb(self, client, userdata, message):
+		# Runs on the MQTT client thread; capture and recognition happen on the worker
+		device = message.topic.split('/')[1]
+		received = time.time()
+		try:
+			msg_json = json.loads(message.payload)
+		except ValueError:
+			msg_json = {}
+		motion_t = msg_json['t'] - msg_json.get('dt', {}).get('motion', 0) if 't' in msg_json else received
+		with self.lock:
+			if device in self.pending:
+				return
+			self.pending.add(device)
+		try:
+			self.queue.put_nowait((device, motion_t, received))
+		except Full:
+			with self.lock:
+				self.pending.discard(device)
 
+	def run(self):
+		while True:
+			(device, motion_t, received) = self.queue.get()
+			with self.lock:
+				self.pending.discard(device)
+			self.client.publish(f"pet-feeder/{device}/identity", json.dumps(self.identify(motion_t, received)), 1)
 
+	def identify(self, motion_t, received):
+		queued = time.time() - received
+		start = time.perf_counter()
+		frames = self.source.burst(burst_len)
+		captured = time.perf_counter()
+		best = {}
+		self.recognizer.detector.reset()
+		for gray in frames:
+			for (box, name, conf) in self.recognizer.recognize(gray):
+				best[name] = max(conf, best.get(name, 0.0))
+		done = time.perf_counter()
+		return {
+			'pets': [{'name': name, 'conf': round(conf, 2)} for (name, conf) in best.items()],
+			'motion': motion_t,
+			'ms': {'uplink': round((received - motion_t) * 1e3),
+			       'queue': round(queued * 1e3),
+			       'capture': round((captured - start) * 1e3),
+			       'recognize': round((done - captured) * 1e3)}
+		}
 
 
+if __name__ == '__main__':
+	import argparse
+	parser = argparse.ArgumentParser(description="Recognize pets when a feeder sees motion")
+	parser.add_argument('-b', '--broker', help="host:port of a local MQTT broker to use instead of AWS IoT")
+	parser.add_argument('-r', '--replay', help="directory of pictures to use instead of the camera")
+	args = parser.parse_args()
 
+	ip_addr = 'a2ot5vs3yt7xtc-ats.iot.us-west-2.amazonaws.com'
+	port = 8883
+	if args.broker:
+		sys.path.append(os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'server', 'src'))
+		from localmqtt import LocalMQTTClient
+		aws_client = LocalMQTTClient("motion")
+		(ip_addr, port) = args.broker.split(':')
+		port = int(port)
+	else:
+		aws_client = AWSIoTMQTTClient("motion")
+	aws_client.configureEndpoint(ip_addr, port)
+	aws_client.configureCredentials(root_cert, private_key, cert)
 
+	aws_client.configureAutoReconnectBackoffTime(1, 32, 20)
+	aws_client.configureOfflinePublishQueueing(-1)  # Infinite offline Publish queueing
+	aws_client.configureDrainingFrequency(2)  # Draining: 2 Hz
+	aws_client.configureConnectDisconnectTimeout(10)  # 10 sec
+	aws_client.configureMQTTOperationTimeout(5)  # 5 sec
 
+	source = ReplaySource(args.replay) if args.replay else PiCameraSource()
+	daemon = CaptureDaemon(aws_client, source, Recognizer(detector=FrontEnd()))
+	aws_client.connect()
+	aws_client.subscribe("pet-feeder/+/motion", 1, daemon.sub_cb)
+	daemon.run()
@@ -1,21 +1,49 @@
 import cv2
+import os
 import sys
 import numpy as np
 
+CASCADE = "haarcascade_frontalcatface.xml"
 
-def show(f):
-    faceCascade = cv2.CascadeClassifier("haarcascade_frontalcatface.xml")
 
+class FaceDetector:
+    """Holds a loaded cascade so it is parsed once, not on every call."""
+
+    def __init__(self, cascade_path=None, scale_factor=1.02, min_neighbors=3, min_size=(150, 150)):
+        if cascade_path is None:
+            cascade_path = CASCADE if os.path.exists(CASCADE) else os.path.join(cv2.data.haarcascades, CASCADE)
+        self.cascade = cv2.CascadeClassifier(cascade_path)
+        if self.cascade.empty():
+            raise IOError(f"Could not load cascade {cascade_path}")
+        self.scale_factor = scale_factor
+        self.min_neighbors = min_neighbors
+        self.min_size = min_size
+
+    def detect(self, gray):
+        return self.cascade.detectMultiScale(
+            gray,
+            scaleFactor=self.scale_factor,
+            minNeighbors=self.min_neighbors,
+            minSize=self.min_size,
+            flags=cv2.CASCADE_SCALE_IMAGE
+        )
+
+
+_detector = None
+
+
+def detector() -> FaceDetector:
+    global _detector
+    if _detector is None:
+        _detector = FaceDetector()
+    return _detector
+
+
+def show(f):
     img = cv2.imread(f)
     gray = cv2.cvtColor(img, cv2.COLOR_BGR2GRAY)
 
-    faces = faceCascade.detectMultiScale(
-        gray,
-        scaleFactor=1.02,
-        minNeighbors=3,
-        minSize=(150, 150),
-        flags=cv2.CASCADE_SCALE_IMAGE
-    )
+    faces = detector().detect(gray)
 
     for (x, y, w, h) in faces:
         cv2.rectangle(img, (x, y), (x + w, y + h), (0, 0, 255), 2)
@@ -28,18 +56,10 @@ def show(f):
 
 
 def crop(f: str) -> np.ndarray:
-    faceCascade = cv2.CascadeClassifier("haarcascade_frontalcatface.xml")
-
     img = cv2.imread(f)
     gray = cv2.cvtColor(img, cv2.COLOR_BGR2GRAY)
 
-    faces = faceCascade.detectMultiScale(
-        gray,
-        scaleFactor=1.02,
-        minNeighbors=3,
-        minSize=(150, 150),
-        flags=cv2.CASCADE_SCALE_IMAGE
-    )
+    faces = detector().detect(gray)
 
     for (x, y, w, h) in faces:
         crop_img = img[y:y + h, x:x + w]
@@ -0,0 +1,171 @@
+"""
+Detection front-end for full-resolution camera frames.
+
+Running the cascade on a 2592x1944 capture at scaleFactor 1.02 scans
+hundreds of scales over the whole frame. The front-end instead
+
+1) halves the frame with pyrDown while it is at least twice `working_width`,
+2) restricts the search to the bowl ROI,
+3) within the ROI, only searches the bounding box of what moved since the
+   previous frame (the whole ROI on the first frame or after a miss),
+4) tracks found faces by template matching in a small window around their
+   last position and only re-runs the cascade every `redetect_every` frames
+   or when the track is lost.
+
+Boxes are returned in full-resolution coordinates, so FaceDetector and
+FrontEnd are interchangeable as the detector of a Recognizer.
+
+Run from automated_functions:
+    python -m face_detection.frontend
+"""
+
+import os
+import sys
+import time
+
+import cv2
+import numpy as np
+
+from face_detection.cat_face_detection import FaceDetector
+
+
+class FrontEnd:
+
+    def __init__(self, working_width=640, roi=None, redetect_every=10, motion_threshold=25,
+                 track_threshold=0.6, detector=None):
+        # roi is (x, y, w, h) as fractions of the frame, e.g. the bowl area
+        self.working_width = working_width
+        self.roi = roi
+        self.redetect_every = redetect_every
+        self.motion_threshold = motion_threshold
+        self.track_threshold = track_threshold
+        # 150 px faces at full resolution are ~40 px at the working size
+        self.detector = detector or FaceDetector(scale_factor=1.1, min_neighbors=3, min_size=(32, 32))
+        self.reset()
+
+    def reset(self):
+        self.prev = None
+        self.tracks = []
+        self.since_detect = 0
+
+    def downsample(self, gray):
+        scale = 1
+        while gray.shape[1] >= 2 * self.working_width:
+            gray = cv2.pyrDown(gray)
+            scale *= 2
+        return gray, scale
+
+    def roi_rect(self, shape):
+        (h, w) = shape[:2]
+        if self.roi is None:
+            return (0, 0, w, h)
+        (fx, fy, fw, fh) = self.roi
+        return (int(fx * w), int(fy * h), int(fw * w), int(fh * h))
+
+    def motion_rect(self, small, roi):
+        # Bounding box of the pixels that changed since the previous frame, inside roi
+        (x, y, w, h) = roi
+        if self.prev is None or self.prev.shape != small.shape:
+            return roi
+        diff = cv2.absdiff(small[y:y + h, x:x + w], self.prev[y:y + h, x:x + w])
+        _, mask = cv2.threshold(diff, self.motion_threshold, 255, cv2.THRESH_BINARY)
+        mask = cv2.dilate(mask, None, iterations=4)
+        points = cv2.findNonZero(mask)
+        if points is None:
+            return None
+        (mx, my, mw, mh) = cv2.boundingRect(points)
+        return (x + mx, y + my, mw, mh)
+
+    def track(self, small):
+        # Template match each face in a window twice its size; drop lost tracks
+        tracks = []
+        for (box, template) in self.tracks:
+            (x, y, w, h) = box
+            x0 = max(0, x - w // 2)
+            y0 = max(0, y - h // 2)
+            window = small[y0:y0 + 2 * h, x0:x0 + 2 * w]
+            if window.shape[0] < h or window.shape[1] < w:
+                continue
+            result = cv2.matchTemplate(window, template, cv2.TM_CCOEFF_NORMED)
+            _, score, _, (dx, dy) = cv2.minMaxLoc(result)
+            if score < self.track_threshold:
+                continue
+            box = (x0 + dx, y0 + dy, w, h)
+            tracks.append((box, small[box[1]:box[1] + h, box[0]:box[0] + w].copy()))
+        return tracks
+
+    def search(self, small, rect):
+        (x, y, w, h) = rect
+        (mw, mh) = self.detector.min_size
+        if w < mw or h < mh:
+            return []
+        faces = self.detector.detect(small[y:y + h, x:x + w])
+        return [((x + fx, y + fy, fw, fh), small[y + fy:y + fy + fh, x + fx:x + fx + fw].copy())
+                for (fx, fy, fw, fh) in faces]
+
+    def detect(self, gray):
+        small, scale = self.downsample(gray)
+        if self.tracks and self.since_detect < self.redetect_every:
+            tracks = self.track(small)
+            if len(tracks) == len(self.tracks):
+                self.tracks = tracks
+                self.since_detect += 1
+                self.prev = small
+                return self.boxes(scale)
+
+        roi = self.roi_rect(small.shape)
+        rect = roi if self.tracks else self.motion_rect(small, roi)
+        self.tracks = self.search(small, rect) if rect is not None else []
+        self.since_detect = 0
+        self.prev = small
+        return self.boxes(scale)
+
+    def boxes(self, scale):
+        return np.array([[v * scale for v in box] for (box, _) in self.tracks], dtype=int).reshape(-1, 4)
+
+
+def iou(a, b):
+    (ax, ay, aw, ah) = a
+    (bx, by, bw, bh) = b
+    w = min(ax + aw, bx + bw) - max(ax, bx)
+    h = min(ay + ah, by + bh) - max(ay, by)
+    if w <= 0 or h <= 0:
+        return 0.0
+    inter = w * h
+    return inter / (aw * ah + bw * bh - inter)
+
+
+def bench(data_dir, frames_per_image=10):
+    # Every sample picture is played as a short still sequence. The reference
+    # is the plain full-resolution detector run on every frame.
+    images = [cv2.imread(os.path.join(data_dir, name), cv2.IMREAD_GRAYSCALE)
+              for name in sorted(os.listdir(data_dir)) if name.lower().endswith(('.jpg', '.jpeg', '.png'))]
+    reference = FaceDetector()
+    frontend = FrontEnd()
+
+    ref_time = 0.0
+    fe_time = 0.0
+    truth = 0
+    hits = 0
+    for gray in images:
+        start = time.perf_counter()
+        expected = reference.detect(gray)
+        ref_time += (time.perf_counter() - start) * frames_per_image
+
+        frontend.reset()
+        for _ in range(frames_per_image):
+            start = time.perf_counter()
+            found = frontend.detect(gray)
+            fe_time += time.perf_counter() - start
+        truth += len(expected)
+        hits += sum(1 for e in expected if any(iou(e, f) > 0.3 for f in found))
+
+    frames = len(images) * frames_per_image
+    print("reference: {:.1f} ms/frame".format(ref_time / frames * 1e3))
+    print("front-end: {:.1f} ms/frame, {:.1f}x faster".format(fe_time / frames * 1e3, ref_time / fe_time))
+    print("recall: {}/{} reference faces".format(hits, truth))
+
+
+if __name__ == '__main__':
+    data_dir = sys.argv[1] if len(sys.argv) > 1 else os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'data')
+    bench(data_dir)
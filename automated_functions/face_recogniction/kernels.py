@@ -0,0 +1,181 @@
+"""
+Dedicated float32 kernels for eigenface projection and RBF-SVM scoring.
+
+sklearn evaluates PCA.transform and SVC.decision_function in float64
+through general code paths (libsvm computes kernel values one support
+vector at a time). Here both stages are single float32 matrix products,
+which numpy hands to the BLAS build for the platform (AVX2 on x86, NEON on
+the Pi):
+
+    projection  Z = (X - mean) @ W            W = components.T / sqrt(var)
+    distances   D = |z|^2 + |sv|^2 - 2 Z @ SV.T
+    decision    F = exp(-gamma D) @ C + b
+
+C folds the libsvm one-vs-one dual coefficients into one column per class
+pair, so all pairs are scored in a single product. F is turned into the
+one-vs-rest decision exactly as SVC(decision_function_shape='ovr') does.
+
+The one-vs-rest values are vote counts, not probabilities, so confidence
+comes from `probability` instead: each pair's decision value goes through
+a sigmoid fitted to held-out decision values at training time (Platt
+scaling, see training.platt) and the pairwise probabilities are coupled
+into one distribution per face the way libsvm does for predict_proba.
+
+Run from automated_functions to check agreement with sklearn and time
+batches of 1 to 256 faces:
+    python -m face_recogniction.kernels
+"""
+
+import time
+
+import numpy as np
+
+
+class Kernels:
+
+    def __init__(self, mean, W, support_vectors, gamma, C, intercept, classes, prob_a, prob_b):
+        self.mean = np.ascontiguousarray(mean, dtype=np.float32)
+        self.W = np.ascontiguousarray(W, dtype=np.float32)
+        self.sv = np.ascontiguousarray(support_vectors, dtype=np.float32)
+        self.sv_norm = np.einsum('ij,ij->i', self.sv, self.sv)
+        self.gamma = np.float32(gamma)
+        self.C = np.ascontiguousarray(C, dtype=np.float32)
+        self.intercept = np.ascontiguousarray(intercept, dtype=np.float32)
+        self.classes = np.asarray(classes)
+        self.prob_a = np.ascontiguousarray(prob_a, dtype=np.float32)
+        self.prob_b = np.ascontiguousarray(prob_b, dtype=np.float32)
+
+    @classmethod
+    def from_sklearn(cls, pca, svc, platt=None):
+        # platt is (A, B) per class pair from training.platt; without it every
+        # pair is scored 50/50 and only the decision values are meaningful
+        W = pca.components_.T
+        if pca.whiten:
+            W = W / np.sqrt(pca.explained_variance_)
+        n_classes = len(svc.classes_)
+        if n_classes == 2:
+            # public coefficients are already signed so that positive means classes_[1]
+            C = svc.dual_coef_.T
+        else:
+            starts = np.r_[0, np.cumsum(svc.n_support_)]
+            C = np.zeros((len(svc.support_vectors_), n_classes * (n_classes - 1) // 2))
+            p = 0
+            for i in range(n_classes):
+                for j in range(i + 1, n_classes):
+                    C[starts[i]:starts[i + 1], p] = svc.dual_coef_[j - 1, starts[i]:starts[i + 1]]
+                    C[starts[j]:starts[j + 1], p] = svc.dual_coef_[i, starts[j]:starts[j + 1]]
+                    p += 1
+        (prob_a, prob_b) = platt if platt is not None else (np.zeros(C.shape[1]), np.zeros(C.shape[1]))
+        return cls(pca.mean_, W, svc.support_vectors_, svc._gamma, C, svc.intercept_, svc.classes_, prob_a, prob_b)
+
+    def project(self, X):
+        X = np.asarray(X, dtype=np.float32)
+        return (X - self.mean) @ self.W
+
+    def pairwise(self, Z):
+        # one decision value per class pair, positive for the first class of
+        # the pair (for two classes: positive for classes[1], like sklearn)
+        Z = np.asarray(Z, dtype=np.float32)
+        D = Z @ self.sv.T
+        D *= -2
+        D += np.einsum('ij,ij->i', Z, Z)[:, None]
+        D += self.sv_norm
+        np.maximum(D, 0, out=D)
+        D *= -self.gamma
+        np.exp(D, out=D)
+        F = D @ self.C
+        F += self.intercept
+        return F
+
+    def decision(self, Z):
+        F = self.pairwise(Z)
+        if len(self.classes) == 2:
+            return F[:, 0]
+        return ovr(F, len(self.classes))
+
+    def decision_function(self, X):
+        return self.decision(self.project(X))
+
+    def probability(self, X):
+        """Calibrated class probabilities, N x n_classes like SVC.predict_proba."""
+        # probability that each pair is won by the class its value is positive for
+        r = 1 / (1 + np.exp(self.prob_a * self.pairwise(self.project(X)) + self.prob_b))
+        if len(self.classes) == 2:
+            return np.column_stack([1 - r[:, 0], r[:, 0]])
+        return couple(r, len(self.classes))
+
+
+def ovr(F, n_classes):
+    # sklearn.svm's one-vs-one to one-vs-rest transform: votes plus a
+    # confidence term squashed into (-1/3, 1/3) that only breaks ties
+    votes = np.zeros((len(F), n_classes), dtype=np.float32)
+    conf = np.zeros((len(F), n_classes), dtype=np.float32)
+    p = 0
+    for i in range(n_classes):
+        for j in range(i + 1, n_classes):
+            conf[:, i] += F[:, p]
+            conf[:, j] -= F[:, p]
+            votes[:, i] += F[:, p] >= 0
+            votes[:, j] += F[:, p] < 0
+            p += 1
+    return votes + conf / (3 * (np.abs(conf) + 1))
+
+
+def couple(r, n_classes):
+    # libsvm's multiclass_probability (Wu, Lin and Weng, method 2): p
+    # minimises sum over pairs of (r_ji p_i - r_ij p_j)^2 with sum(p) = 1,
+    # where r_ij = P(i | i or j). That is one (n+1) x (n+1) linear system
+    # per face, solved directly instead of libsvm's fixed-point iteration
+    r = np.clip(r.astype(np.float64), 1e-7, 1 - 1e-7)
+    R = np.zeros((len(r), n_classes, n_classes))
+    p = 0
+    for i in range(n_classes):
+        for j in range(i + 1, n_classes):
+            R[:, i, j] = r[:, p]
+            R[:, j, i] = 1 - r[:, p]
+            p += 1
+    A = np.ones((len(r), n_classes + 1, n_classes + 1))
+    A[:, :n_classes, :n_classes] = -R * R.transpose(0, 2, 1)
+    diag = np.arange(n_classes)
+    A[:, diag, diag] = (R * R).sum(axis=1)
+    A[:, n_classes, n_classes] = 0
+    rhs = np.zeros((len(r), n_classes + 1, 1))
+    rhs[:, n_classes] = 1
+    P = np.maximum(np.linalg.solve(A, rhs)[:, :n_classes, 0], 0)
+    return P / P.sum(axis=1, keepdims=True)
+
+
+def bench(pca, svc, X):
+    kernels = Kernels.from_sklearn(pca, svc)
+    ref = svc.decision_function(pca.transform(X))
+    out = kernels.decision_function(X)
+    agree = (ref > 0) == (out > 0) if ref.ndim == 1 else ref.argmax(axis=1) == out.argmax(axis=1)
+    print("max abs error vs sklearn {:.2e}, same decision {}/{}".format(np.abs(ref - out).max(), agree.sum(), len(X)))
+
+    batch = 1
+    while batch <= 256:
+        faces = X[np.arange(batch) % len(X)]
+        rounds = max(3, 2000 // batch)
+        start = time.perf_counter()
+        for _ in range(rounds):
+            svc.decision_function(pca.transform(faces))
+        sk = (time.perf_counter() - start) / rounds
+        start = time.perf_counter()
+        for _ in range(rounds):
+            kernels.decision_function(faces)
+        k = (time.perf_counter() - start) / rounds
+        print("batch {:3d}: sklearn {:8.1f} us  kernels {:8.1f} us  {:5.1f}x".format(batch, sk * 1e6, k * 1e6, sk / k))
+        batch *= 2
+
+
+if __name__ == '__main__':
+    import os
+    import pickle
+    from face_recogniction.training import DATA_DIR, train
+
+    with open(os.path.join(DATA_DIR, 'ims.pkl'), 'rb') as f:
+        X = np.asarray(pickle.load(f))
+    with open(os.path.join(DATA_DIR, 'labels.pkl'), 'rb') as f:
+        y = np.asarray(pickle.load(f))
+    pca, clf, _ = train(X, y)
+    bench(pca, clf, X)
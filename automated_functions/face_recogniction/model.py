@@ -0,0 +1,91 @@
+"""
+Versioned, memory-mappable model file for the face recognizer.
+
+    header   magic 'ECAT', version, n_features, n_components,
+             n_support, n_pairs, n_classes, gamma
+    arrays   mean     float32 [n_features]
+             W        float32 [n_features, n_components]
+             sv       float32 [n_support, n_components]
+             C        float32 [n_support, n_pairs]
+             b        float32 [n_pairs]
+             probA    float32 [n_pairs]
+             probB    float32 [n_pairs]
+             classes  int32   [n_classes]
+    names    uint32 length + UTF-8 JSON list of pet names
+
+Every array starts on a 64-byte boundary at an offset that follows from
+the header alone, so loading is one mmap and a few np.frombuffer views; no
+pixel data is copied and sklearn is not needed at inference time.
+"""
+
+import json
+import mmap
+import os
+import struct
+
+import numpy as np
+
+from face_recogniction.kernels import Kernels
+
+MAGIC = b'ECAT'
+VERSION = 2
+HEADER = struct.Struct('<4sHxxIIIIIf')
+ALIGN = 64
+
+
+def _layout(n_features, n_components, n_support, n_pairs, n_classes):
+    shapes = [('mean', np.float32, (n_features,)),
+              ('W', np.float32, (n_features, n_components)),
+              ('sv', np.float32, (n_support, n_components)),
+              ('C', np.float32, (n_support, n_pairs)),
+              ('b', np.float32, (n_pairs,)),
+              ('probA', np.float32, (n_pairs,)),
+              ('probB', np.float32, (n_pairs,)),
+              ('classes', np.int32, (n_classes,))]
+    offset = HEADER.size
+    layout = []
+    for (name, dtype, shape) in shapes:
+        offset = (offset + ALIGN - 1) // ALIGN * ALIGN
+        layout.append((name, dtype, shape, offset))
+        offset += int(np.prod(shape)) * np.dtype(dtype).itemsize
+    return layout, offset
+
+
+def save(path, kernels, names):
+    (n_support, n_pairs) = kernels.C.shape
+    (n_features, n_components) = kernels.W.shape
+    n_classes = len(kernels.classes)
+    arrays = {'mean': kernels.mean, 'W': kernels.W, 'sv': kernels.sv, 'C': kernels.C,
+              'b': kernels.intercept, 'probA': kernels.prob_a, 'probB': kernels.prob_b,
+              'classes': kernels.classes}
+    layout, end = _layout(n_features, n_components, n_support, n_pairs, n_classes)
+
+    tmp = path + '.tmp'
+    with open(tmp, 'wb') as f:
+        f.write(HEADER.pack(MAGIC, VERSION, n_features, n_components, n_support, n_pairs, n_classes, kernels.gamma))
+        for (name, dtype, shape, offset) in layout:
+            f.write(b'\0' * (offset - f.tell()))
+            f.write(np.ascontiguousarray(arrays[name], dtype=dtype).tobytes())
+        blob = json.dumps(list(names)).encode()
+        f.write(struct.pack('<I', len(blob)) + blob)
+    os.replace(tmp, path)
+
+
+def load(path):
+    """Returns (Kernels, names) backed by a read-only mapping of the file."""
+    with open(path, 'rb') as f:
+        buf = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+    (magic, version, n_features, n_components, n_support, n_pairs, n_classes, gamma) = HEADER.unpack_from(buf)
+    if magic != MAGIC:
+        raise ValueError(f"{path} is not a model file")
+    if version != VERSION:
+        raise ValueError(f"{path} is model version {version}, expected {VERSION}")
+
+    layout, end = _layout(n_features, n_components, n_support, n_pairs, n_classes)
+    arrays = {name: np.frombuffer(buf, dtype, int(np.prod(shape)), offset).reshape(shape)
+              for (name, dtype, shape, offset) in layout}
+    (length,) = struct.unpack_from('<I', buf, end)
+    names = json.loads(bytes(buf[end + 4:end + 4 + length]))
+    kernels = Kernels(arrays['mean'], arrays['W'], arrays['sv'], gamma, arrays['C'], arrays['b'], arrays['classes'],
+                      arrays['probA'], arrays['probB'])
+    return kernels, names
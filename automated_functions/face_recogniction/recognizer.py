@@ -0,0 +1,86 @@
+"""
+Long-lived cat face recognizer.
+
+The cascade, PCA basis and SVM are loaded once when the Recognizer is
+created instead of every time a picture is classified, so a frame costs one
+detection pass plus one projection and one SVM evaluation per face.
+
+The model file is written by `python -m face_recogniction.training` and
+mapped read-only, so start-up takes milliseconds and needs no sklearn.
+
+Run from automated_functions:
+    python -m face_recogniction.recognizer image.jpg
+    python -m face_recogniction.recognizer --bench
+"""
+
+import os
+import sys
+import time
+
+import cv2
+import numpy as np
+
+from face_detection import cat_face_detection as detect
+from face_recogniction import model
+from face_recogniction.training import DATA_DIR, FACE_SIZE, MODEL_PATH
+
+
+class Recognizer:
+
+    def __init__(self, model_path=MODEL_PATH, detector=None):
+        self.detector = detector or detect.FaceDetector()
+        self.kernels, self.names = model.load(model_path)
+
+    def classify(self, faces: np.ndarray):
+        """faces is N x 4096 gray pixels; returns (pet index, confidence) arrays.
+
+        The confidence is the calibrated probability of the chosen pet, so a
+        threshold on it means the same thing however many pets there are.
+        """
+        p = self.kernels.probability(faces)
+        return p.argmax(axis=1), p.max(axis=1)
+
+    def recognize(self, gray: np.ndarray):
+        """Returns [(box, pet name, confidence)] for every face in a gray frame."""
+        boxes = self.detector.detect(gray)
+        if len(boxes) == 0:
+            return []
+        faces = np.array([cv2.resize(gray[y:y + h, x:x + w], (FACE_SIZE, FACE_SIZE)).reshape(-1)
+                          for (x, y, w, h) in boxes])
+        pets, conf = self.classify(faces)
+        labels = self.kernels.classes
+        return [(tuple(int(v) for v in box), self.names[labels[pet]], float(c))
+                for box, pet, c in zip(boxes, pets, conf)]
+
+
+def bench(recognizer, rounds=5):
+    frames = []
+    for name in sorted(os.listdir(DATA_DIR)):
+        if name.lower().endswith(('.jpg', '.jpeg', '.png')):
+            frames.append(cv2.imread(os.path.join(DATA_DIR, name), cv2.IMREAD_GRAYSCALE))
+
+    latency = []
+    found = 0
+    for _ in range(rounds):
+        for gray in frames:
+            start = time.perf_counter()
+            found += len(recognizer.recognize(gray))
+            latency.append(time.perf_counter() - start)
+    latency.sort()
+    print("{} frames, {} faces, {:.1f} fps".format(len(latency), found, len(latency) / sum(latency)))
+    print("latency p50 {:.1f} ms  p99 {:.1f} ms".format(latency[len(latency) // 2] * 1e3,
+                                                      latency[int(len(latency) * 0.99)] * 1e3))
+
+
+if __name__ == '__main__':
+    start = time.perf_counter()
+    recognizer = Recognizer()
+    print("loaded in {:.2f} s".format(time.perf_counter() - start))
+
+    if sys.argv[1] == '--bench':
+        bench(recognizer)
+        sys.exit(0)
+
+    gray = cv2.imread(sys.argv[1], cv2.IMREAD_GRAYSCALE)
+    for box, name, conf in recognizer.recognize(gray):
+        print(box, name, "{:.2f}".format(conf))
@@ -1,20 +1,200 @@
+"""
+Training command for the face recognizer.
+
+Fits the eigenface PCA and the RBF-SVM (grid search over C and gamma in
+parallel) plus one sigmoid per pair of pets that turns decision values
+into calibrated probabilities, prints a report on a held-out split, refits
+on all faces and writes the model file that Recognizer loads.
+
+Faces come either from ims.pkl/labels.pkl, with the pet names asked for on
+the console, or from a directory holding one sub-directory of pictures per
+pet. Cropped faces are cached in <dir>/crops.pkl keyed by file, size and
+modification time, so re-training after adding pictures only runs the
+detector on the new ones.
+
+Run from automated_functions:
+    python -m face_recogniction.training
+    python -m face_recogniction.training --faces ~/cats -o data/eigencat.model
+"""
+
+import argparse
+import multiprocessing
+import os
 import pickle
 import sys
+
 import numpy as np
-from sklearn.decomposition import PCA as RandomizedPCA
-from sklearn.model_selection import train_test_split
-from sklearn.svm import SVC
-from sklearn.metrics import confusion_matrix, classification_report
-from sklearn.model_selection import GridSearchCV
-
-num = input("How many cats are going to use this feeder?\n")
-try:
-    num = int(num)
-except ValueError:
-    sys.exit("Input is not correct, only integer will be accepted.")
-
-names = []
-for i in range(num):
-    names.append(input(f"Cat {i}'s name is?\n"))
-if len(set(names)) != len(names):
-    sys.exit("Duplication in names.")
\ No newline at end of file
+
+from face_recogniction import model
+from face_recogniction.kernels import Kernels
+
+DATA_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'data')
+MODEL_PATH = os.path.join(DATA_DIR, 'eigencat.model')
+FACE_SIZE = 64
+
+
+def ask_names():
+    num = input("How many cats are going to use this feeder?\n")
+    try:
+        num = int(num)
+    except ValueError:
+        sys.exit("Input is not correct, only integer will be accepted.")
+
+    names = []
+    for i in range(num):
+        names.append(input(f"Cat {i}'s name is?\n"))
+    if len(set(names)) != len(names):
+        sys.exit("Duplication in names.")
+    return names
+
+
+_detector = None
+
+
+def crop_face(path):
+    # Largest face in the picture as FACE_SIZE x FACE_SIZE gray pixels, or None
+    import cv2
+    from face_detection.cat_face_detection import FaceDetector
+
+    global _detector
+    if _detector is None:
+        _detector = FaceDetector()
+    gray = cv2.imread(path, cv2.IMREAD_GRAYSCALE)
+    if gray is None:
+        return None
+    faces = _detector.detect(gray)
+    if len(faces) == 0:
+        return None
+    (x, y, w, h) = max(faces, key=lambda f: f[2] * f[3])
+    return cv2.resize(gray[y:y + h, x:x + w], (FACE_SIZE, FACE_SIZE)).reshape(-1)
+
+
+def load_faces(faces_dir, jobs):
+    cache_path = os.path.join(faces_dir, 'crops.pkl')
+    cache = {}
+    if os.path.exists(cache_path):
+        with open(cache_path, 'rb') as f:
+            cache = pickle.load(f)
+
+    names = sorted(d for d in os.listdir(faces_dir) if os.path.isdir(os.path.join(faces_dir, d)))
+    files = []
+    for (label, name) in enumerate(names):
+        pet_dir = os.path.join(faces_dir, name)
+        for f in sorted(os.listdir(pet_dir)):
+            path = os.path.join(pet_dir, f)
+            st = os.stat(path)
+            files.append(((path, st.st_size, st.st_mtime_ns), label))
+
+    missing = [key for (key, _) in files if key not in cache]
+    if missing:
+        print(f"Cropping {len(missing)} new pictures")
+        with multiprocessing.Pool(jobs) as pool:
+            for (key, face) in zip(missing, pool.map(crop_face, [key[0] for key in missing])):
+                cache[key] = face
+        with open(cache_path, 'wb') as f:
+            pickle.dump(cache, f)
+
+    X = [cache[key] for (key, _) in files if cache[key] is not None]
+    y = [label for (key, label) in files if cache[key] is not None]
+    print(f"{len(X)} faces in {len(files)} pictures of {len(names)} pets")
+    return np.array(X), np.array(y), names
+
+
+def train(X, y, jobs=-1):
+    from sklearn.decomposition import PCA as RandomizedPCA
+    from sklearn.model_selection import GridSearchCV
+    from sklearn.svm import SVC
+
+    # Perform unsupervised dimensionality reduction using principal component analysis.
+    # The resulting components are the eigenfaces.
+    pca = RandomizedPCA(n_components=16, whiten=True)
+    X_tr = pca.fit_transform(X)
+
+    # search for optimal SVM parameters using grid search with 3-fold cross validation;
+    # the 40 x 3 fits are spread over `jobs` processes
+    Cs = np.logspace(0, 4, 5)
+    gammas = np.logspace(-6, 1, 8)
+    param_grid = {'C': Cs, 'kernel': ['rbf'], 'gamma': gammas}
+    clf = GridSearchCV(estimator=SVC(), param_grid=param_grid, n_jobs=jobs, cv=3)
+    clf.fit(X_tr, y)
+    return pca, clf.best_estimator_, platt(pca, clf.best_params_, X, y)
+
+
+def platt(pca, params, X, y, folds=5):
+    """Fits (A, B) per class pair so P = 1 / (1 + exp(A f + B)) for f from Kernels.pairwise.
+
+    The decision values come from SVMs that did not see the face, as in
+    libsvm's probability training; a sigmoid fitted to the training faces'
+    own margins would be overconfident.
+    """
+    from scipy.optimize import minimize
+    from sklearn.model_selection import StratifiedKFold
+    from sklearn.svm import SVC
+
+    classes = np.unique(y)
+    n = len(classes)
+    # the class each pair's decision value is positive for, and the other one
+    pairs = [(classes[1], classes[0])] if n == 2 else [(classes[i], classes[j]) for i in range(n) for j in range(i + 1, n)]
+    F = np.zeros((len(X), len(pairs)))
+    folds = min(folds, int(np.unique(y, return_counts=True)[1].min()))
+    for (fit, held) in StratifiedKFold(folds, shuffle=True, random_state=0).split(X, y):
+        svc = SVC(**params).fit(pca.transform(X[fit]), y[fit])
+        kernels = Kernels.from_sklearn(pca, svc)
+        F[held] = kernels.pairwise(kernels.project(X[held]))
+
+    A = np.zeros(len(pairs))
+    B = np.zeros(len(pairs))
+    for (p, (pos, neg)) in enumerate(pairs):
+        sel = (y == pos) | (y == neg)
+        f = F[sel, p]
+        (n_pos, n_neg) = ((y[sel] == pos).sum(), (y[sel] == neg).sum())
+        # Platt's targets, pulled off 0 and 1 so the sigmoid stays finite on separable data
+        t = np.where(y[sel] == pos, (n_pos + 1) / (n_pos + 2), 1 / (n_neg + 2))
+
+        def loss(ab):
+            z = ab[0] * f + ab[1]
+            return np.sum(t * np.logaddexp(0, z) + (1 - t) * np.logaddexp(0, -z))
+
+        (A[p], B[p]) = minimize(loss, [0.0, np.log((n_neg + 1) / (n_pos + 1))], method='BFGS').x
+    return A, B
+
+
+def main():
+    from sklearn.metrics import confusion_matrix, classification_report
+    from sklearn.model_selection import train_test_split
+
+    parser = argparse.ArgumentParser(description="Train the cat face recognizer")
+    parser.add_argument('--faces', help="directory with one sub-directory of pictures per pet")
+    parser.add_argument('-o', '--output', default=MODEL_PATH)
+    parser.add_argument('-j', '--jobs', type=int, default=-1, help="parallel grid search fits (-1: all cores)")
+    parser.add_argument('--test-size', type=int, default=15)
+    args = parser.parse_args()
+
+    if args.faces:
+        X, y, names = load_faces(args.faces, args.jobs if args.jobs > 0 else None)
+    else:
+        with open(os.path.join(DATA_DIR, 'ims.pkl'), 'rb') as f:
+            X = np.asarray(pickle.load(f))
+        with open(os.path.join(DATA_DIR, 'labels.pkl'), 'rb') as f:
+            y = np.asarray(pickle.load(f))
+        names = ask_names()
+    if len(names) <= int(y.max()):
+        sys.exit(f"Got {len(names)} names for {int(y.max()) + 1} pets.")
+
+    X_train, X_test, y_train, y_test = train_test_split(X, y, test_size=args.test_size)
+    pca, clf, sigmoids = train(X_train, y_train, args.jobs)
+    y_hat = clf.predict(pca.transform(X_test))
+    print(clf)
+    print(classification_report(y_test, y_hat, labels=np.unique(y), target_names=[names[i] for i in np.unique(y)]))
+    print(confusion_matrix(y_test, y_hat))
+
+    conf = Kernels.from_sklearn(pca, clf, sigmoids).probability(X_test).max(axis=1)
+    print("confidence p10 {:.2f}  p50 {:.2f} on held-out faces".format(np.percentile(conf, 10), np.percentile(conf, 50)))
+
+    pca, clf, sigmoids = train(X, y, args.jobs)
+    model.save(args.output, Kernels.from_sklearn(pca, clf, sigmoids), names)
+    print(f"Wrote {args.output}")
+
+
+if __name__ == '__main__':
+    main()
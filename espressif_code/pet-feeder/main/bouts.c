@@ -0,0 +1,147 @@
+/**
+ * @file bouts.c
+ * @brief One-sided CUSUM segmenter for eating bouts.
+ *
+ * Each sample adds (level - weight - BOUT_K_MG), floored at 0, and a sum over
+ * BOUT_H_MG starts a bout. While no bout is building up the level follows the
+ * weight slowly, which absorbs drift and noise. A bout ends once the weight
+ * has not hit a new low for BOUT_QUIET_S; bouts under BOUT_MIN_MG are dropped.
+ *
+ * server/src/bouts.py mirrors this step for step for tuning, and test/ runs
+ * both over the same weight traces.
+ */
+
+#include <stdint.h>
+
+#include "esp_attr.h"
+#include "esp_log.h"
+
+#include "bouts.h"
+
+#define BOUT_K_MG 1000 //below the level that still counts as noise
+#define BOUT_H_MG 4000
+#define BOUT_LEVEL_DIV 20 //the level moves 1/20 of the way to each sample
+#define BOUT_REFILL_MG 5000 //a rise this large is a refill and resets the level
+#define BOUT_QUIET_S 60
+#define BOUT_MIN_MG 2000
+
+static const char *TAG = "bouts";
+
+/* Segmenter state, carried across deep sleep */
+RTC_DATA_ATTR static struct {
+    char primed; //level is valid
+    char active; //a bout is in progress
+    int32_t level; //resting weight
+    int32_t cusum;
+    uint32_t onset; //first sample of the current drop
+    int32_t low; //lowest weight of the bout so far
+    uint32_t low_at;
+    int32_t peak_rate;
+} seg;
+RTC_DATA_ATTR static bout_t bouts[BOUT_QUEUE];
+RTC_DATA_ATTR static volatile uint8_t bouts_head = 0; //written by weight_task
+RTC_DATA_ATTR static volatile uint8_t bouts_tail = 0; //read by aws_iot_task
+
+/* rest is the weight the bowl settled at, the lowest sample is biased low by
+ * the noise. Returns 1 when the bout was long enough to keep. */
+static int bout_close(int32_t rest)
+{
+    bout_t* b;
+    int32_t mg = seg.level - rest;
+    
+    seg.active = 0;
+    if(mg < BOUT_MIN_MG)
+    {
+        return 0;
+    }
+    if((uint8_t)(bouts_head - bouts_tail) >= BOUT_QUEUE)
+    {
+        ESP_LOGW(TAG, "Bout queue full, dropping the oldest bout");
+        bouts_tail++;
+    }
+    b = &bouts[bouts_head % BOUT_QUEUE];
+    b->start = seg.onset;
+    b->end = seg.low_at;
+    b->mg = mg;
+    b->peak_rate = seg.peak_rate;
+    bouts_head++;
+    ESP_LOGI(TAG, "Eating bout: %d mg over %u s, peak %d mg/min", mg, b->end - b->start, b->peak_rate);
+    return 1;
+}
+
+/* Returns 1 when the sample finished a bout */
+int bout_update(uint32_t t, int32_t w, int dispensing)
+{
+    int32_t rate;
+    int closed = 0;
+    
+    //dispensing and refills are not eating
+    if(!seg.primed || dispensing || (w > seg.level + BOUT_REFILL_MG))
+    {
+        if(seg.active)
+        {
+            closed = bout_close(seg.low);
+        }
+        seg.primed = 1;
+        seg.level = w;
+        seg.cusum = 0;
+        return closed;
+    }
+    
+    if(seg.active)
+    {
+        if(w < seg.low)
+        {
+            rate = (seg.low - w) * 60 / (int32_t)(t > seg.low_at ? t - seg.low_at : 1);
+            if(rate > seg.peak_rate)
+            {
+                seg.peak_rate = rate;
+            }
+            seg.low = w;
+            seg.low_at = t;
+        }
+        else if(t - seg.low_at >= BOUT_QUIET_S)
+        {
+            closed = bout_close(w);
+            seg.level = w;
+            seg.cusum = 0;
+        }
+        return closed;
+    }
+    
+    if(seg.cusum == 0)
+    {
+        seg.onset = t;
+    }
+    seg.cusum += seg.level - w - BOUT_K_MG;
+    if(seg.cusum <= 0)
+    {
+        seg.cusum = 0;
+        seg.level += (w - seg.level) / BOUT_LEVEL_DIV;
+    }
+    else if(seg.cusum >= BOUT_H_MG)
+    {
+        seg.active = 1;
+        seg.low = w;
+        seg.low_at = t;
+        seg.peak_rate = (seg.level - w) * 60 / (int32_t)(t > seg.onset ? t - seg.onset : 1);
+    }
+    return 0;
+}
+
+int bouts_pending(void)
+{
+    return bouts_tail != bouts_head;
+}
+
+/* Oldest finished bout into b; returns 0 when there is none */
+int bout_next(bout_t* b)
+{
+    if(bouts_tail == bouts_head)
+    {
+        return 0;
+    }
+    *b = bouts[bouts_tail % BOUT_QUEUE];
+    bouts_tail++;
+    return 1;
+}
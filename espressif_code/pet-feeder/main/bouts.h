@@ -0,0 +1,27 @@
+/**
+ * @file bouts.h
+ * @brief Eating bouts segmented from the bowl weight sampled on every wake.
+ *
+ * weight_task feeds every sample to bout_update; finished bouts wait in a
+ * queue of BOUT_QUEUE until aws_iot_task takes them with bout_next. Times
+ * are steady_time() seconds, weights integer milligrams.
+ */
+#ifndef BOUTS_H
+#define BOUTS_H
+
+#include <stdint.h>
+
+#define BOUT_QUEUE 4 //finished bouts waiting to be published
+
+typedef struct {
+    uint32_t start;
+    uint32_t end; //time of the last new low
+    int32_t mg;
+    int32_t peak_rate; //milligrams per minute
+} bout_t;
+
+int bout_update(uint32_t t, int32_t w, int dispensing);
+int bouts_pending(void);
+int bout_next(bout_t* b);
+
+#endif
@@ -0,0 +1,335 @@
+/**
+ * @file journal.c
+ * @brief Circular log of telemetry records in the "journal" flash partition.
+ *
+ * Every sector starts with a journal_sector_t carrying an increasing sequence
+ * number, so the newest and oldest sectors are found again after a power
+ * cycle. Sectors are erased in turn as the head comes around, which spreads
+ * the wear evenly; uploaded records are marked by clearing their state byte,
+ * which needs no erase. When the log is full the oldest sector is dropped.
+ *
+ * Only esp_partition is used, so test/ builds this file on the host against
+ * a simulated flash.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "esp_spi_flash.h"
+
+#include "journal.h"
+
+#define JOURNAL_MAGIC 0x4c4e524a //"JRNL"
+#define JOURNAL_FREE 0xffff //length of a record that has not been written
+#define JOURNAL_UNSENT 0xff
+#define JOURNAL_SENT 0x00
+#define JOURNAL_OPEN "{\"journal\":["
+#define JOURNAL_CLOSE "]}"
+
+static const char *TAG = "journal";
+
+typedef struct {
+    uint32_t magic;
+    uint32_t seq;
+} journal_sector_t;
+
+typedef struct {
+    uint16_t len; //length of the JSON that follows
+    uint8_t state; //JOURNAL_UNSENT, then JOURNAL_SENT once uploaded
+    uint8_t check; //sum of the JSON bytes, catches records torn by a power loss
+} journal_record_t;
+
+/* Where the journal stands, kept in RTC memory so only a power-on has to
+ * scan the partition. Offsets are from the start of the partition. */
+RTC_DATA_ATTR static struct {
+    uint32_t magic; //JOURNAL_MAGIC when the rest is valid
+    uint32_t seq; //sequence number of the head sector
+    uint32_t head; //where the next record goes
+    uint32_t tail; //oldest record that may be unsent
+    uint32_t pending; //records not uploaded yet
+} journal;
+static const esp_partition_t* journal_part = NULL;
+
+static uint32_t journal_align(uint32_t len)
+{
+    return (len + 3) & ~3;
+}
+
+static uint8_t journal_check(const char* data, uint16_t len)
+{
+    uint8_t sum = 0;
+    while(len--)
+    {
+        sum += (uint8_t)*data++;
+    }
+    return sum;
+}
+
+static uint32_t journal_sector_start(uint32_t offset)
+{
+    return offset - (offset % SPI_FLASH_SEC_SIZE);
+}
+
+static uint32_t journal_next_sector(uint32_t offset)
+{
+    return (journal_sector_start(offset) + SPI_FLASH_SEC_SIZE) % journal_part->size;
+}
+
+static int journal_record_valid(uint32_t offset, const journal_record_t* rec)
+{
+    return (rec->len != JOURNAL_FREE) && ((offset % SPI_FLASH_SEC_SIZE) + sizeof(*rec) + rec->len <= SPI_FLASH_SEC_SIZE);
+}
+
+/* Header of the record at *offset, moving *offset on to the next sector
+ * when the current one has no more records. Returns 0 at the head. */
+static int journal_record_at(uint32_t* offset, journal_record_t* rec)
+{
+    while(*offset != journal.head)
+    {
+        if((*offset % SPI_FLASH_SEC_SIZE) + sizeof(*rec) <= SPI_FLASH_SEC_SIZE)
+        {
+            esp_partition_read(journal_part, *offset, rec, sizeof(*rec));
+            if(journal_record_valid(*offset, rec))
+            {
+                return 1;
+            }
+        }
+        //the head sector ends the journal even if the head is at its very end
+        if(journal_sector_start(*offset) == journal_sector_start(journal.head - 1))
+        {
+            return 0;
+        }
+        *offset = journal_next_sector(*offset) + sizeof(journal_sector_t);
+    }
+    return 0;
+}
+
+static void journal_start_sector(uint32_t offset, uint32_t seq)
+{
+    journal_sector_t hdr = {JOURNAL_MAGIC, seq};
+    esp_partition_erase_range(journal_part, offset, SPI_FLASH_SEC_SIZE);
+    esp_partition_write(journal_part, offset, &hdr, sizeof(hdr));
+    journal.seq = seq;
+    journal.head = offset + sizeof(hdr);
+}
+
+/* Rebuild the journal position after a power cycle */
+static void journal_scan(void)
+{
+    journal_sector_t hdr;
+    journal_record_t rec;
+    uint32_t offset, newest = 0, oldest = 0, oldest_seq = UINT32_MAX;
+    
+    journal.seq = 0;
+    for(offset = 0; offset < journal_part->size; offset += SPI_FLASH_SEC_SIZE)
+    {
+        esp_partition_read(journal_part, offset, &hdr, sizeof(hdr));
+        if(hdr.magic != JOURNAL_MAGIC)
+        {
+            continue;
+        }
+        if(hdr.seq >= journal.seq)
+        {
+            journal.seq = hdr.seq;
+            newest = offset;
+        }
+        if(hdr.seq < oldest_seq)
+        {
+            oldest_seq = hdr.seq;
+            oldest = offset;
+        }
+    }
+    if(journal.seq == 0)
+    {
+        journal_start_sector(0, 1);
+        journal.tail = journal.head;
+        journal.pending = 0;
+        journal.magic = JOURNAL_MAGIC;
+        return;
+    }
+    
+    //the head is the first unwritten record of the newest sector; after a
+    //torn header the rest of the sector is given up
+    journal.head = newest + sizeof(hdr);
+    while(journal.head + sizeof(rec) <= newest + SPI_FLASH_SEC_SIZE)
+    {
+        esp_partition_read(journal_part, journal.head, &rec, sizeof(rec));
+        if(rec.len == JOURNAL_FREE)
+        {
+            break;
+        }
+        if(!journal_record_valid(journal.head, &rec))
+        {
+            journal.head = newest + SPI_FLASH_SEC_SIZE;
+            break;
+        }
+        journal.head += journal_align(sizeof(rec) + rec.len);
+    }
+    if(journal.head > newest + SPI_FLASH_SEC_SIZE)
+    {
+        journal.head = newest + SPI_FLASH_SEC_SIZE;
+    }
+    
+    //the tail is the first unsent record from the oldest sector on
+    journal.tail = oldest + sizeof(hdr);
+    journal.pending = 0;
+    offset = journal.tail;
+    while(journal_record_at(&offset, &rec))
+    {
+        if(rec.state == JOURNAL_UNSENT)
+        {
+            if(!journal.pending)
+            {
+                journal.tail = offset;
+            }
+            journal.pending++;
+        }
+        offset += journal_align(sizeof(rec) + rec.len);
+    }
+    if(!journal.pending)
+    {
+        journal.tail = journal.head;
+    }
+    journal.magic = JOURNAL_MAGIC;
+}
+
+void journal_open(void)
+{
+    journal_part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, JOURNAL_SUBTYPE, "journal");
+    if(journal_part == NULL)
+    {
+        ESP_LOGW(TAG, "No journal partition, telemetry is dropped while offline");
+        return;
+    }
+    if(journal.magic != JOURNAL_MAGIC)
+    {
+        journal_scan();
+    }
+    ESP_LOGI(TAG, "Journal has %u records to upload", journal.pending);
+}
+
+void journal_append(const char* data)
+{
+    journal_record_t rec;
+    uint32_t next, offset;
+    uint16_t len = strlen(data);
+    uint32_t size = journal_align(sizeof(rec) + len);
+    
+    if(journal_part == NULL)
+    {
+        return;
+    }
+    //head - 1 is always inside the head sector, the head itself may be at its end
+    if(journal_sector_start(journal.head - 1) != journal_sector_start(journal.head + size - 1))
+    {
+        next = journal_next_sector(journal.head - 1);
+        //the log is full: give up the oldest sector's records
+        if(journal.pending && journal_sector_start(journal.tail) == next)
+        {
+            offset = journal.tail;
+            while(journal_record_at(&offset, &rec) && journal_sector_start(offset) == next)
+            {
+                if(rec.state == JOURNAL_UNSENT)
+                {
+                    journal.pending--;
+                }
+                offset += journal_align(sizeof(rec) + rec.len);
+            }
+            ESP_LOGW(TAG, "Journal full, dropped the oldest sector");
+            journal.tail = journal_next_sector(next) + sizeof(journal_sector_t);
+        }
+        journal_start_sector(next, journal.seq + 1);
+        if(!journal.pending)
+        {
+            journal.tail = journal.head;
+        }
+    }
+    rec.len = len;
+    rec.state = JOURNAL_UNSENT;
+    rec.check = journal_check(data, len);
+    esp_partition_write(journal_part, journal.head, &rec, sizeof(rec));
+    esp_partition_write(journal_part, journal.head + sizeof(rec), data, len);
+    journal.head += size;
+    journal.pending++;
+}
+
+uint32_t journal_pending(void)
+{
+    return journal_part ? journal.pending : 0;
+}
+
+/* Fill buf with as many unsent records from the tail on as fit in size
+ * bytes. A record too large for any upload is dropped, so it can't hold up
+ * the rest of the journal.
+ */
+void journal_batch(char* buf, size_t size, journal_batch_t* batch)
+{
+    journal_record_t rec;
+    uint32_t offset = journal.tail;
+    size_t pos = strlen(JOURNAL_OPEN);
+    size_t sep;
+    
+    memcpy(buf, JOURNAL_OPEN, pos);
+    batch->added = 0;
+    batch->taken = 0;
+    batch->end = offset;
+    while(journal_part != NULL && journal_record_at(&offset, &rec))
+    {
+        if(rec.state == JOURNAL_UNSENT)
+        {
+            sep = batch->added ? 1 : 0;
+            if(strlen(JOURNAL_OPEN) + rec.len + strlen(JOURNAL_CLOSE) > size)
+            {
+                ESP_LOGW(TAG, "Dropping a %u byte record, too large to upload", rec.len);
+            }
+            else if(pos + sep + rec.len + strlen(JOURNAL_CLOSE) > size)
+            {
+                break;
+            }
+            else
+            {
+                esp_partition_read(journal_part, offset + sizeof(rec), buf + pos + sep, rec.len);
+                if(journal_check(buf + pos + sep, rec.len) == rec.check)
+                {
+                    if(sep)
+                    {
+                        buf[pos] = ',';
+                    }
+                    pos += sep + rec.len;
+                    batch->added++;
+                }
+            }
+            batch->taken++;
+        }
+        offset += journal_align(sizeof(rec) + rec.len);
+        batch->end = offset;
+    }
+    memcpy(buf + pos, JOURNAL_CLOSE, strlen(JOURNAL_CLOSE));
+    batch->len = pos + strlen(JOURNAL_CLOSE);
+}
+
+/* Mark what a batch took as sent, torn records included so they are not retried */
+void journal_commit(const journal_batch_t* batch)
+{
+    journal_record_t rec;
+    uint32_t offset = journal.tail;
+    
+    if(journal_part == NULL)
+    {
+        return;
+    }
+    while(offset != batch->end && journal_record_at(&offset, &rec))
+    {
+        if(rec.state == JOURNAL_UNSENT)
+        {
+            rec.state = JOURNAL_SENT;
+            esp_partition_write(journal_part, offset + 2, &rec.state, 1);
+        }
+        offset += journal_align(sizeof(rec) + rec.len);
+    }
+    journal.tail = batch->end;
+    journal.pending -= batch->taken;
+}
@@ -0,0 +1,33 @@
+/**
+ * @file journal.h
+ * @brief Telemetry journal kept in flash while the broker is unreachable.
+ *
+ * Batches that can't be published are appended to the "journal" data
+ * partition (see partitions.csv) and uploaded in bulk as
+ * {"journal": [batch, ...]} once the connection is back. Uploading is the
+ * caller's job: journal_batch fills a buffer with as many unsent records as
+ * fit, and journal_commit marks them sent once the publish went out.
+ */
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define JOURNAL_SUBTYPE 0x40
+
+/* One bulk upload, filled in by journal_batch */
+typedef struct {
+    size_t len; //bytes of {"journal":[...]} in the buffer
+    uint32_t added; //records in it, nothing to publish when 0
+    uint32_t taken; //records it uses up, torn and oversized ones included
+    uint32_t end; //where the next batch starts
+} journal_batch_t;
+
+void journal_open(void);
+void journal_append(const char* data);
+uint32_t journal_pending(void);
+void journal_batch(char* buf, size_t size, journal_batch_t* batch);
+void journal_commit(const journal_batch_t* batch);
+
+#endif
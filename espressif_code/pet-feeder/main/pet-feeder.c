@@ -19,7 +19,8 @@
  * @brief Waits for JSON from AWS and determines whether to dispense food or now. Enters low power when not dispensing or transmitting.
  *
  * This example takes the parameters from the build configuration and establishes a connection to the AWS IoT MQTT Platform.
- * It subscribes to topic "pet-feeder/from_aws" and publishes to topic "pet-feeder/to_aws"
+ * It subscribes to topic "pet-feeder/<device id>/from_aws" and publishes to topic "pet-feeder/<device id>/to_aws".
+ * The device id is read from NVS key "device_id" in namespace "pet-feeder", or derived from the WiFi MAC.
  *
  * Some setup is required. See example README for details.
  *
@@ -30,6 +31,7 @@
 #include <unistd.h>
 #include <limits.h>
 #include <string.h>
+#include <sys/time.h>
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
@@ -53,6 +55,7 @@
 #include "driver/ledc.h"
 #include "driver/adc.h"
 #include "esp_attr.h"
+#include "esp_partition.h"
 
 #include "driver/adc.h"
 #include "esp_adc_cal.h"
@@ -60,6 +63,10 @@
 #include "nvs.h"
 #include "nvs_flash.h"
 
+#include "lwip/sockets.h"
+#include "lwip/netdb.h"
+#include "mbedtls/md.h"
+
 #include "aws_iot_config.h"
 #include "aws_iot_log.h"
 #include "aws_iot_version.h"
@@ -68,9 +75,11 @@
 
 #include "../../json/cJSON/cJSON.h"
 
+#include "bouts.h"
+#include "journal.h"
+#include "weight.h"
+
 #define NOP() asm volatile ("nop")
-#define WS_BASELINE 1077
-#define WS_GRAMS_PER_COUNT 0.0485608
 #define WS_EN 21
 #define WS_ADC 34
 #define SRV_EN 17
@@ -85,7 +94,11 @@
 #define PWM_TIMER1 LEDC_TIMER_3
 
 static const char *TAG = "pet-feeder";
-const static int serial_num = 123456;
+
+#define TOPIC_PREFIX "pet-feeder"
+#define DEVICE_ID_LEN 33
+#define TOPIC_LEN 64
+static char device_id[DEVICE_ID_LEN];
 
 /* The examples use simple WiFi configuration that you can set via
    'make menuconfig'.
@@ -104,9 +117,119 @@ const static int serial_num = 123456;
 #define SERVO_MIN_PULSEWIDTH1 320 //Minimum pulse width in microsecond
 #define SERVO_MAX_PULSEWIDTH1 2650 //Maximum pulse width in microsecond
 #define SERVO_MAX_DEGREE 180 //Maximum angle in degree upto which servo can rotate
-#define SERVO_PERIOD 20000.0
+#define SERVO_OPEN_DEGREE (SERVO_MAX_DEGREE-40) //Angle at which a hopper gate is fully open
+#define SERVO_PERIOD 20000 //microseconds
 #define MAX_TIMER 32767
 
+#define RX_MSG_LEN CONFIG_AWS_IOT_MQTT_RX_BUF_LEN //Anything the MQTT client can receive fits whole
+#define MAX_PORTION_G 1000 //Largest portion accepted, keeps grams * 1000 in an int32_t
+
+#define NUM_FEED_CHANNELS 2
+#define PORTION_QUEUE_LEN 8
+#define DISPENSE_TIMEOUT_MS 30000 //Give up on a portion if the hopper runs dry
+
+/* Each servo gates its own hopper and is dispensed independently.
+ * open_degree and overshoot_mg are calibrated per channel over MQTT.
+ * overshoot_mg is the food still in flight when the gate closes, so
+ * the gate starts closing that many milligrams before the target is reached.
+ */
+typedef struct {
+    int gpio;
+    ledc_channel_t pwm_channel;
+    uint32_t min_pulsewidth;
+    uint32_t max_pulsewidth;
+    char inverted; //gate opens towards 0 degrees
+    uint32_t open_degree;
+    int32_t overshoot_mg;
+    int dispense_amount; //grams dispensed on a scheduled dispense
+} feed_channel_t;
+
+typedef struct {
+    uint8_t channel;
+    int grams;
+    uint32_t cmd_id; //command that queued this portion, 0 if none
+} portion_t;
+
+#define TX_MSG_LEN 512
+#define DEDUPE_WINDOW 8
+#define YIELD_MS 50 //Longest an inbound message waits in the socket before its callback runs
+#define TELEMETRY_PERIOD_MS 5000 //Outbound telemetry is batched and published at this cadence
+#define WAKE_DRAIN_MS 1500 //Time after connecting for the broker to deliver commands queued while asleep
+#define MOTION_HOLD_MS 3000 //After motion, stay awake and ready to dispense this long for a decision
+#define WIFI_WAIT_MS 8000 //Longest wait at wake for the access point before working offline
+#define CONNECT_ATTEMPTS 3 //Broker connects per wake before working offline
+#define WEIGHT_REQUESTED 1
+#define WEIGHT_CHECK 2 //weighed on wake, only reported by exception
+
+/* Wall time comes from SNTP and is carried across deep sleep by the RTC
+ * timer behind gettimeofday. It is resynced every CLOCK_RESYNC_S. Each sync
+ * steps time(NULL); bouts and report intervals are timed with
+ * steady_time(), which takes the steps back out, so an interval that spans
+ * a sync (or the first sync after power on) keeps its length.
+ */
+#define SNTP_SERVER "pool.ntp.org"
+#define SNTP_PORT "123"
+#define NTP_UNIX_OFFSET 2208988800UL //seconds from 1900 to 1970
+#define CLOCK_RESYNC_S (6 * 3600)
+
+/* LAN control channel packet: "PF", version, type, sequence number (big
+ * endian), device id length, device id, JSON payload, then the first
+ * LAN_MAC_LEN bytes of an HMAC-SHA256 over everything before it.
+ * Types: 'D' discover (hub), 'A' announce (device), 'C' command (hub),
+ * 'T' telemetry (device). The hub broadcasts a discover when it sees the
+ * device wake; once one of its packets checks out, telemetry for the rest
+ * of the wake goes to the hub instead of AWS. The announce echoes the
+ * discover's sequence number so the hub can tell it is not a replay.
+ * Sequence numbers never go back, not even across a power cycle: the
+ * highest one accepted is kept in NVS, and transmit numbers are reserved
+ * there LAN_SEQ_BLOCK at a time.
+ */
+#define LAN_PORT 4210
+#define LAN_VERSION 2
+#define LAN_KEY_LEN 32
+#define LAN_MAC_LEN 16
+#define LAN_HEADER_LEN 9
+#define LAN_PKT_LEN (LAN_HEADER_LEN + DEVICE_ID_LEN + TX_MSG_LEN + LAN_MAC_LEN)
+#define LAN_SEQ_BLOCK 256
+
+/* Offline telemetry goes to the journal (journal.h) and is uploaded in bulk,
+ * each upload as large as one publish packet in the MQTT client's TX buffer
+ * allows: besides the payload that holds the fixed header (up to 5 bytes),
+ * the topic with its 2 byte length and the 2 byte packet id of QoS1.
+ */
+#define MQTT_PUBLISH_OVERHEAD 9
+#define JOURNAL_DRAIN_BATCHES 4 //Bulk uploads per pass of the main loop
+
+/* Result of a command, acknowledged to AWS by command id */
+typedef enum {
+    CMD_PENDING = 0,
+    CMD_OK,
+    CMD_DONE,
+    CMD_INVALID,
+    CMD_BUSY,
+} cmd_result_t;
+
+static const char *cmd_result_str[] = {"pending", "ok", "done", "invalid", "busy"};
+
+/* Item in tx_queue. type is 'w' weight, 'd' dispensed, 'm' motion, 'a' ack,
+ * 'l' motion to dispense latency, 'c' clock sync or 'b' eating bouts. time is the wall time
+ * of the event in seconds, 0 while the clock has never been synced. */
+typedef struct {
+    char type;
+    uint32_t cmd_id;
+    cmd_result_t result;
+    uint32_t time;
+} tx_event_t;
+
+/* Recently seen command ids and their results so that retransmitted
+ * commands are acknowledged again instead of being executed twice.
+ * Kept in RTC memory so the window survives deep sleep.
+ */
+typedef struct {
+    uint32_t cmd_id;
+    cmd_result_t result;
+} dedupe_entry_t;
+
 /* FreeRTOS event group to signal when we are connected & ready to make a request */
 static EventGroupHandle_t wifi_event_group;
 
@@ -120,6 +243,34 @@ static QueueHandle_t tx_queue;
 
 static char rx_queue_empty = 0;
 static char tx_queue_empty = 0;
+static volatile char tx_urgent = 0; //publish the telemetry batch now instead of at the next period
+static volatile TickType_t awake_until = 0; //no deep sleep before this tick
+static volatile char prewarmed = 0; //load cell powered and servos holding the gates after motion
+static volatile char dispense_active = 0;
+static volatile int64_t motion_at = -1; //esp_timer time of the motion still waiting for a dispense, or -1
+static uint32_t motion_latency_ms; //motion to gate opening of the last dispense
+
+static char journal_buf[CONFIG_AWS_IOT_MQTT_TX_BUF_LEN];
+
+/* Clock sync state, the offset and drift are reported with the 'c' event */
+RTC_DATA_ATTR static time_t clock_synced_at = 0; //wall time of the last sync, 0 until the first
+RTC_DATA_ATTR static int32_t clock_stepped_s = 0; //sum of the steps the syncs made to time(NULL)
+static int32_t clock_offset_ms = 0;
+static int32_t clock_drift_ppm = 0;
+
+/* LAN control channel, only enabled when a key has been provisioned */
+static uint8_t lan_key[LAN_KEY_LEN];
+static char lan_enabled = 0;
+static int lan_sock = -1;
+static struct sockaddr_in lan_hub; //address of the hub that last sent a valid packet
+static char lan_hub_known = 0; //not kept across deep sleep, every wake is discovered again
+RTC_DATA_ATTR static uint32_t lan_tx_seq = 0;
+RTC_DATA_ATTR static uint32_t lan_tx_reserved = 0; //lan_tx_seq can go up to this before NVS is updated
+RTC_DATA_ATTR static uint32_t lan_rx_seq = 0; //highest sequence number accepted from the hub
+
+/* Access point of the last association, so a wake can skip the scan */
+RTC_DATA_ATTR static uint8_t ap_bssid[6];
+RTC_DATA_ATTR static uint8_t ap_channel = 0;
 
 /* CA Root certificate, device ("Thing") certificate and device
  * ("Thing") key.
@@ -151,10 +302,12 @@ static const char * ROOT_CA_PATH = CONFIG_EXAMPLE_ROOT_CA_PATH;
 #error "Invalid method for loading certs"
 #endif
 
-const static float SERVO_MAX_DUTY0 = (float)SERVO_MAX_PULSEWIDTH/SERVO_PERIOD;
-const static float SERVO_MAX_DUTY1 = (float)SERVO_MAX_PULSEWIDTH/SERVO_PERIOD;
-const static float SERVO_MIN_DUTY0 = (float)SERVO_MIN_PULSEWIDTH/SERVO_PERIOD;
-const static float SERVO_MIN_DUTY1 = (float)SERVO_MIN_PULSEWIDTH/SERVO_PERIOD;
+static feed_channel_t feed_channels[NUM_FEED_CHANNELS] = {
+    {SRV0, PWM_CHANNEL0, SERVO_MIN_PULSEWIDTH0, SERVO_MAX_PULSEWIDTH0, 0, SERVO_OPEN_DEGREE, 0, 0},
+    {SRV1, PWM_CHANNEL1, SERVO_MIN_PULSEWIDTH1, SERVO_MAX_PULSEWIDTH1, 1, SERVO_OPEN_DEGREE, 0, 0},
+};
+static QueueHandle_t portion_queue;
+
 static ledc_timer_config_t timer_conf;
 static ledc_channel_config_t ledc_conf;
 
@@ -164,9 +317,22 @@ static const adc_atten_t atten = ADC_ATTEN_DB_11;
 static const adc_unit_t unit = ADC_UNIT_1;
 
 static char time_dispense = 0;
-static char sample_weight = 0;
-static int dispense_amount = 0;
-static float weight = 0;
+static uint32_t dispense_cmd_id = 0;
+RTC_DATA_ATTR static dedupe_entry_t dedupe_window[DEDUPE_WINDOW];
+RTC_DATA_ATTR static uint8_t dedupe_next = 0;
+static char sample_weight = 0; //WEIGHT_REQUESTED or WEIGHT_CHECK while a sample is due
+static int32_t weight_mg = 0; //weights are integer milligrams, grams only on the JSON side
+
+/* Report by exception: with a deadband set, the bowl is weighed on every
+ * wake and the weight only goes out when it moved by at least the deadband
+ * since the last report, or when report_interval_s has passed. A deadband
+ * of 0 is the polled mode, where weight is only sent when requested.
+ */
+RTC_DATA_ATTR static int32_t report_deadband_mg = 0;
+RTC_DATA_ATTR static uint32_t report_interval_s = 0;
+RTC_DATA_ATTR static int32_t reported_mg = 0;
+RTC_DATA_ATTR static uint32_t reported_at = 0; //steady_time() of the last report
+
 static xQueueHandle interrupt_queue = NULL;
 
 
@@ -185,16 +351,76 @@ char HostAddress[255] = AWS_IOT_MQTT_HOST;
 uint32_t port = AWS_IOT_MQTT_PORT;
 
 
+/* Device id from NVS if provisioned, else the station MAC in hex */
+static void load_device_id(void)
+{
+    nvs_handle handle;
+    size_t len = sizeof(device_id);
+    uint8_t mac[6];
+    esp_err_t err;
+    
+    if(nvs_open(TOPIC_PREFIX, NVS_READONLY, &handle) == ESP_OK)
+    {
+        err = nvs_get_str(handle, "device_id", device_id, &len);
+        nvs_close(handle);
+        if((err == ESP_OK) && (len > 1))
+        {
+            return;
+        }
+    }
+    
+    esp_read_mac(mac, ESP_MAC_WIFI_STA);
+    snprintf(device_id, sizeof(device_id), "%02x%02x%02x%02x%02x%02x", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+}
+
+/* Pre-shared LAN key from NVS; without one the LAN channel stays off */
+static void load_lan_key(void)
+{
+    nvs_handle handle;
+    size_t len = sizeof(lan_key);
+    
+    if(nvs_open(TOPIC_PREFIX, NVS_READONLY, &handle) == ESP_OK)
+    {
+        lan_enabled = (nvs_get_blob(handle, "lan_key", lan_key, &len) == ESP_OK) && (len == sizeof(lan_key));
+        //RTC memory keeps the sequence numbers across deep sleep, NVS across a power cycle
+        if(lan_tx_reserved == 0)
+        {
+            nvs_get_u32(handle, "lan_rx_seq", &lan_rx_seq);
+            nvs_get_u32(handle, "lan_tx_seq", &lan_tx_reserved);
+            lan_tx_seq = lan_tx_reserved;
+        }
+        nvs_close(handle);
+    }
+}
+
+static void store_lan_seq(const char* key, uint32_t seq)
+{
+    nvs_handle handle;
+    
+    if(nvs_open(TOPIC_PREFIX, NVS_READWRITE, &handle) == ESP_OK)
+    {
+        nvs_set_u32(handle, key, seq);
+        nvs_commit(handle);
+        nvs_close(handle);
+    }
+}
+
 static esp_err_t event_handler(void *ctx, system_event_t *event)
 {
     switch(event->event_id) {
     case SYSTEM_EVENT_STA_START:
         esp_wifi_connect();
         break;
+    case SYSTEM_EVENT_STA_CONNECTED:
+        memcpy(ap_bssid, event->event_info.connected.bssid, sizeof(ap_bssid));
+        ap_channel = event->event_info.connected.channel;
+        break;
     case SYSTEM_EVENT_STA_GOT_IP:
         xEventGroupSetBits(wifi_event_group, CONNECTED_BIT);
         break;
     case SYSTEM_EVENT_STA_DISCONNECTED:
+        /* The cached access point may be gone; scan next time */
+        ap_channel = 0;
         /* This is a workaround as ESP32 WiFi libs don't currently
            auto-reassociate. */
         esp_wifi_connect();
@@ -206,13 +432,115 @@ static esp_err_t event_handler(void *ctx, system_event_t *event)
     return ESP_OK;
 }
 
+/* Keep the device out of deep sleep for at least ms from now */
+static void stay_awake(uint32_t ms)
+{
+    TickType_t until = xTaskGetTickCount() + pdMS_TO_TICKS(ms);
+    if((int32_t)(until - awake_until) > 0)
+    {
+        awake_until = until;
+    }
+}
+
+static uint32_t wall_time(void)
+{
+    return clock_synced_at ? (uint32_t)time(NULL) : 0;
+}
+
+/* Seconds that never jump, synced or not; only differences mean anything */
+static uint32_t steady_time(void)
+{
+    return (uint32_t)time(NULL) - (uint32_t)clock_stepped_s;
+}
+
+static void queue_tx(char type, uint32_t cmd_id, cmd_result_t result)
+{
+    tx_event_t event = {type, cmd_id, result, wall_time()};
+    tx_queue_empty = 0;
+    xQueueSend(tx_queue, (void*)&event, (TickType_t)0);
+    //motion starts the camera and the dispense gate, it can't wait for the batch
+    if(type == 'm')
+    {
+        tx_urgent = 1;
+        stay_awake(MOTION_HOLD_MS);
+    }
+}
+
+static dedupe_entry_t* dedupe_find(uint32_t cmd_id)
+{
+    uint8_t i;
+    for(i = 0; i < DEDUPE_WINDOW; i++)
+    {
+        if(dedupe_window[i].cmd_id == cmd_id)
+        {
+            return &dedupe_window[i];
+        }
+    }
+    return NULL;
+}
+
+static void dedupe_record(uint32_t cmd_id, cmd_result_t result)
+{
+    dedupe_window[dedupe_next].cmd_id = cmd_id;
+    dedupe_window[dedupe_next].result = result;
+    dedupe_next = (dedupe_next + 1) % DEDUPE_WINDOW;
+}
+
+/* Record the final result of a command and acknowledge it */
+static void complete_cmd(uint32_t cmd_id, cmd_result_t result)
+{
+    dedupe_entry_t* entry;
+    if(cmd_id == 0)
+    {
+        return;
+    }
+    entry = dedupe_find(cmd_id);
+    if(entry)
+    {
+        entry->result = result;
+    }
+    queue_tx('a', cmd_id, result);
+}
+
+/* Returns the feed channel named by an item's "channel" key, or -1 */
+static int json_channel(cJSON* item)
+{
+    cJSON* channel = cJSON_GetObjectItemCaseSensitive(item, "channel");
+    if(cJSON_IsNumber(channel) && (channel->valueint >= 0) && (channel->valueint < NUM_FEED_CHANNELS))
+    {
+        return channel->valueint;
+    }
+    return -1;
+}
+
+/* Fills channel and grams from a {"channel":0,"grams":20} item, 0 if it is not valid */
+static int json_portion(cJSON* item, portion_t* portion)
+{
+    cJSON* grams = cJSON_GetObjectItemCaseSensitive(item, "grams");
+    int ch = json_channel(item);
+    if(ch < 0 || !cJSON_IsNumber(grams) || (grams->valueint <= 0) || (grams->valueint > MAX_PORTION_G))
+    {
+        return 0;
+    }
+    portion->channel = ch;
+    portion->grams = grams->valueint;
+    return 1;
+}
+
 void parse_json(void* params)
 {
     cJSON* json_parser = NULL; //root of JSON key:value tree
     cJSON* object = NULL; //JSON object handle
     cJSON* item = NULL; //JSON item handle
-    char msg[100]; //xQueue message handle
+    cJSON* amount = NULL; //JSON number handle inside an item
+    char msg[RX_MSG_LEN]; //xQueue message handle
     char valid = 0; //Valid flag for logging
+    char dispensing; //command queued food, ack once it has been dispensed
+    int ch; //feed channel index
+    portion_t portion;
+    uint32_t cmd_id; //sequence id of the command, 0 if the sender did not set one
+    dedupe_entry_t* seen;
+    cmd_result_t failure; //result reported when the command is not valid
     
     
     /* Parse JSON messages from AWS.
@@ -223,8 +551,9 @@ void parse_json(void* params)
      */
     while(1)
     {
-        //check if Queue has msg, wait one tick
-        if(xQueueReceive(rx_queue, msg, (TickType_t) 1))
+        //wait up to 10 ticks for a message; a timeout marks the queue empty
+        //so the sleep check knows no command is waiting to be parsed
+        if(xQueueReceive(rx_queue, msg, (TickType_t) 10))
         {      
             ESP_LOGI(TAG, "JSON received: \n%.*s", strlen(msg), msg);
             json_parser = cJSON_Parse(msg); //create cJSON tree from message
@@ -239,6 +568,20 @@ void parse_json(void* params)
                 }
             }
             
+            //retransmitted command, acknowledge again without executing it
+            object = cJSON_GetObjectItemCaseSensitive(json_parser, "id");
+            cmd_id = (cJSON_IsNumber(object) && (object->valuedouble > 0)) ? (uint32_t)object->valuedouble : 0;
+            seen = cmd_id ? dedupe_find(cmd_id) : NULL;
+            if(seen)
+            {
+                ESP_LOGW(TAG, "Duplicate command %u", cmd_id);
+                queue_tx('a', cmd_id, seen->result);
+                cJSON_Delete(json_parser);
+                continue;
+            }
+            dispensing = 0;
+            failure = CMD_INVALID;
+            
             //Point object handle at request objects
             object = cJSON_GetObjectItemCaseSensitive(json_parser, "request");
             if (object)
@@ -251,6 +594,8 @@ void parse_json(void* params)
                     {
                         ESP_LOGI(TAG, "Dispense requested");
                         time_dispense = 1;
+                        dispense_cmd_id = cmd_id;
+                        dispensing = 1;
                         valid = 1;
                         vTaskResume(dispense_task_h);
                     }
@@ -258,7 +603,7 @@ void parse_json(void* params)
                     else if(strncmp(item->valuestring, "weight", 10) == 0)
                     {
                         ESP_LOGI(TAG, "Weight requested");
-                        sample_weight = 1;
+                        sample_weight = WEIGHT_REQUESTED;
                         valid = 1;
                         vTaskResume(weight_task_h);
                     }
@@ -276,12 +621,121 @@ void parse_json(void* params)
             
             //point object handle at update objects
             object = cJSON_GetObjectItemCaseSensitive(json_parser, "update");            
-            if (cJSON_IsNumber(object) && (object->valueint >= 0))
+            if (cJSON_IsNumber(object) && (object->valueint >= 0) && (object->valueint <= MAX_PORTION_G))
             {
                 ESP_LOGI(TAG, "Received weight update request from AWS");
            
                 valid = 1;
-                dispense_amount = (int)object->valueint;
+                //a plain amount is from single hopper feeders, which only have channel 0
+                feed_channels[0].dispense_amount = (int)object->valueint;
+            }
+            //per channel update: [{"channel":0,"amount":40}, ...]
+            else if(cJSON_IsArray(object))
+            {
+                ESP_LOGI(TAG, "Received channel update request from AWS");
+                valid = 1;
+                cJSON_ArrayForEach(item, object)
+                {
+                    ch = json_channel(item);
+                    amount = cJSON_GetObjectItemCaseSensitive(item, "amount");
+                    if(ch >= 0 && cJSON_IsNumber(amount) && (amount->valueint >= 0) && (amount->valueint <= MAX_PORTION_G))
+                    {
+                        feed_channels[ch].dispense_amount = amount->valueint;
+                    }
+                    else
+                    {
+                        valid = 0;
+                    }
+                }
+            }
+            else if(object)
+            {
+                valid = 0;
+            }
+            
+            //report weight by exception: {"deadband": 2.5, "interval": 3600}
+            object = cJSON_GetObjectItemCaseSensitive(json_parser, "report");
+            if(cJSON_IsObject(object))
+            {
+                item = cJSON_GetObjectItemCaseSensitive(object, "deadband");
+                amount = cJSON_GetObjectItemCaseSensitive(object, "interval");
+                if(cJSON_IsNumber(item) && (item->valuedouble >= 0) && cJSON_IsNumber(amount) && (amount->valueint > 0))
+                {
+                    ESP_LOGI(TAG, "Reporting weight past %.1f g or every %d s", item->valuedouble, amount->valueint);
+                    report_deadband_mg = mg_from_grams(item->valuedouble);
+                    report_interval_s = amount->valueint;
+                    reported_at = 0;
+                    valid = 1;
+                }
+                else
+                {
+                    valid = 0;
+                }
+            }
+            
+            //batch of portions run back to back: [{"channel":0,"grams":20}, ...]
+            //all or nothing, so "done" always means every portion was dispensed
+            object = cJSON_GetObjectItemCaseSensitive(json_parser, "portions");
+            if(cJSON_IsArray(object))
+            {
+                ESP_LOGI(TAG, "Received %d portions from AWS", cJSON_GetArraySize(object));
+                valid = 1;
+                cJSON_ArrayForEach(item, object)
+                {
+                    if(!json_portion(item, &portion))
+                    {
+                        valid = 0;
+                    }
+                }
+                //this task is the only one adding portions, so the space can't shrink
+                if(valid && ((int)uxQueueSpacesAvailable(portion_queue) < cJSON_GetArraySize(object)))
+                {
+                    ESP_LOGE(TAG, "Portion queue full, dropping %d portions", cJSON_GetArraySize(object));
+                    failure = CMD_BUSY;
+                    valid = 0;
+                }
+                if(valid)
+                {
+                    cJSON_ArrayForEach(item, object)
+                    {
+                        json_portion(item, &portion);
+                        portion.cmd_id = cmd_id;
+                        xQueueSend(portion_queue, (void*)&portion, (TickType_t)0);
+                        dispensing = 1;
+                    }
+                    vTaskResume(dispense_task_h);
+                }
+            }
+            else if(object)
+            {
+                valid = 0;
+            }
+            
+            //per channel calibration: [{"channel":0,"open_degree":140,"overshoot":2.5}, ...]
+            object = cJSON_GetObjectItemCaseSensitive(json_parser, "calibrate");
+            if(cJSON_IsArray(object))
+            {
+                ESP_LOGI(TAG, "Received calibration from AWS");
+                valid = 1;
+                cJSON_ArrayForEach(item, object)
+                {
+                    ch = json_channel(item);
+                    if(ch < 0)
+                    {
+                        valid = 0;
+                        continue;
+                    }
+                    amount = cJSON_GetObjectItemCaseSensitive(item, "open_degree");
+                    if(cJSON_IsNumber(amount) && (amount->valueint > 0) && (amount->valueint <= SERVO_MAX_DEGREE))
+                    {
+                        feed_channels[ch].open_degree = amount->valueint;
+                    }
+                    amount = cJSON_GetObjectItemCaseSensitive(item, "overshoot");
+                    if(cJSON_IsNumber(amount) && (amount->valuedouble >= 0))
+                    {
+                        feed_channels[ch].overshoot_mg = mg_from_grams(amount->valuedouble);
+                    }
+                }
             }
             else if(object)
             {
@@ -306,20 +760,29 @@ void parse_json(void* params)
             if(valid)
             {
                 valid = 0;
-                ESP_LOGI(TAG, "State: time_dispense = %d\t sample_weight = %d\t dispense_amount = %d", time_dispense, sample_weight, dispense_amount);
+                ESP_LOGI(TAG, "State: time_dispense = %d\t sample_weight = %d\t dispense_amount = %d/%d", time_dispense, sample_weight, feed_channels[0].dispense_amount, feed_channels[1].dispense_amount);
                 xTimerReset(heartbeat_timer, 10);
+                if(cmd_id)
+                {
+                    dedupe_record(cmd_id, dispensing ? CMD_PENDING : CMD_OK);
+                    queue_tx('a', cmd_id, dispensing ? CMD_PENDING : CMD_OK);
+                }
             }
             //invalid JSON, log error
             else
             {
                 ESP_LOGE(TAG, "Invalid request from AWS.\n");
+                if(cmd_id)
+                {
+                    dedupe_record(cmd_id, failure);
+                    queue_tx('a', cmd_id, failure);
+                }
             }
         }
         else
         {
             rx_queue_empty = 1;
         }
-        vTaskDelay(10);
     }
 }
 
@@ -329,26 +792,11 @@ static void IRAM_ATTR motion_isr(void* arg)
     xQueueSendFromISR(interrupt_queue, &gpio_num, NULL);
 }
 
-void motion_task(void* params)
-{
-    uint32_t io_num;
-    char id = 'm';
-    while(1)
-    {
-        if(xQueueReceive(interrupt_queue, &io_num, 10))
-        {
-            ESP_LOGI(TAG, "Motion tripped");
-            tx_queue_empty = 0;
-            xQueueSend(tx_queue, (void*)&id, (TickType_t)0);
-        }
-        vTaskDelay(100);
-    }
-}
-
 void heartbeat_timeout(TimerHandle_t xTimer)
 {
     ESP_LOGW(TAG, "The dispenser has not heard from AWS in over 15 minutes. Dispensing food now...");
     time_dispense = 1;
+    vTaskResume(dispense_task_h);
     xTimerReset(heartbeat_timer, 10);
 }
 
@@ -375,75 +823,208 @@ void IRAM_ATTR delayMicroseconds(uint32_t us)
     }
 }
 
-uint32_t calculate_duty(uint32_t angle, char motor)
+uint32_t calculate_duty(uint32_t angle, const feed_channel_t* fc)
+{
+    uint32_t pulsewidth;
+    pulsewidth = fc->min_pulsewidth + (((fc->max_pulsewidth - fc->min_pulsewidth) * (angle)) / (SERVO_MAX_DEGREE));
+    
+    return (MAX_TIMER * pulsewidth) / SERVO_PERIOD;
+}
+
+/* Drive a channel's gate to 'opening' degrees from its closed position */
+static void set_gate(const feed_channel_t* fc, uint32_t opening)
+{
+    uint32_t angle = fc->inverted ? fc->open_degree - opening : opening;
+    ledc_set_duty_and_update(LEDC_HIGH_SPEED_MODE, fc->pwm_channel, calculate_duty(angle, fc), 0);
+}
+
+/* On motion get ready before any command arrives: power the load cell so
+ * it has settled by the first reading, and power the servos holding the
+ * gates shut so a dispense can open them straight away.
+ */
+static void prewarm(void)
+{
+    char ch;
+    motion_at = esp_timer_get_time();
+    if(prewarmed)
+    {
+        return;
+    }
+    prewarmed = 1;
+    gpio_set_level(WS_EN, 0);
+    if(!dispense_active)
+    {
+        gpio_set_level(SRV_EN, 1);
+        for(ch = 0; ch < NUM_FEED_CHANNELS; ch++)
+        {
+            set_gate(&feed_channels[ch], 0);
+        }
+    }
+}
+
+static void disarm(void)
+{
+    prewarmed = 0;
+    motion_at = -1;
+    gpio_set_level(SRV_EN, 0);
+    gpio_set_level(WS_EN, 1);
+}
+
+void motion_task(void* params)
+{
+    uint32_t io_num;
+    while(1)
+    {
+        if(xQueueReceive(interrupt_queue, &io_num, portMAX_DELAY))
+        {
+            ESP_LOGI(TAG, "Motion tripped");
+            prewarm();
+            queue_tx('m', 0, CMD_OK);
+            //one report per trip
+            vTaskDelay(100);
+            xQueueReset(interrupt_queue);
+        }
+    }
+}
+
+/* Bowl weight in milligrams */
+int32_t read_weight(void)
 {
-    float duty;
-    if(motor == 0)
+    int reading = 0;
+    char iter;
+    
+    //the load cell stays powered while pre-warmed
+    if(!prewarmed)
     {
-        duty = SERVO_MIN_DUTY0 + (((SERVO_MAX_PULSEWIDTH0 - SERVO_MIN_PULSEWIDTH0) * (angle)) / (SERVO_MAX_DEGREE))/SERVO_PERIOD;
+        gpio_set_level(WS_EN, 0);
+        delayMicroseconds(20);
+    }
     
-        duty = (float)MAX_TIMER*duty;
+    for(iter = 0; iter < 64; iter++)
+    {
+        reading += adc1_get_raw((adc1_channel_t)channel);
     }
-    else
+    
+    reading /= 64;
+    if(!prewarmed)
     {
-        duty = SERVO_MIN_DUTY1 + (((SERVO_MAX_PULSEWIDTH1 - SERVO_MIN_PULSEWIDTH1) * (angle)) / (SERVO_MAX_DEGREE))/SERVO_PERIOD;
+        gpio_set_level(WS_EN, 1);
+    }
+    return weight_mg(reading);
+}
+
+/* Open one hopper until the bowl has gained portion->grams, then close it.
+ * The bowl is tared at the start so portions can run back to back.
+ */
+static void dispense_portion(const portion_t* portion)
+{
+    feed_channel_t* fc = &feed_channels[portion->channel];
+    int32_t target;
+    int32_t count;
+    TickType_t start;
     
-        duty = (float)MAX_TIMER*duty;
+    target = read_weight() + portion->grams * 1000 - fc->overshoot_mg;
+    ESP_LOGI(TAG, "Dispensing %d grams of food from channel %d", portion->grams, portion->channel);
+    
+    for (count = 0; count <= (int32_t)fc->open_degree; count+=5) 
+    {
+        set_gate(fc, count);
+        weight_mg = read_weight();
+        if(weight_mg < target)
+        {
+            vTaskDelay(2/portTICK_RATE_MS);    
+        }
+        else
+        {
+            break;
+        }
     }
-    uint32_t duty_int = (uint32_t)duty;
     
-    return duty_int;
+    start = xTaskGetTickCount();
+    while(weight_mg < target)
+    {
+        if((xTaskGetTickCount() - start) > pdMS_TO_TICKS(DISPENSE_TIMEOUT_MS))
+        {
+            ESP_LOGE(TAG, "Channel %d timed out at %d mg, hopper may be empty", portion->channel, weight_mg);
+            break;
+        }
+        vTaskDelay(1);
+        weight_mg = read_weight();
+    }     
+    
+    for (count = count > (int32_t)fc->open_degree ? (int32_t)fc->open_degree : count; count >= 0; count-=15) 
+    {
+        set_gate(fc, count);
+        vTaskDelay(2/portTICK_RATE_MS);     
+    }
+    set_gate(fc, 0);
 }
 
 void dispense_task(void* params)
 {
-    uint32_t timer_duty0;
-    uint32_t timer_duty1;
-    char id = 'd';
-    volatile int32_t count;
+    char ch;
+    uint32_t cmd_id;
+    portion_t next;
+    portion_t portion;
     while(1) 
     {
+        //scheduled dispense feeds every channel its configured amount
         if(time_dispense)
         {
-            ESP_LOGI(TAG, "Dispensing %d grams of food", dispense_amount);
-            gpio_set_level(SRV_EN, 1);
-            
-            for (count = 0; count < SERVO_MAX_DEGREE-39; count+=5) 
+            time_dispense = 0;
+            //the command is acked with its portions, a later heartbeat dispense has none
+            cmd_id = dispense_cmd_id;
+            dispense_cmd_id = 0;
+            if(cmd_id && (feed_channels[0].dispense_amount <= 0) && (feed_channels[1].dispense_amount <= 0))
             {
-                timer_duty0 = calculate_duty(count,0);
-                timer_duty1 = calculate_duty(SERVO_MAX_DEGREE-39-count,1);
-                ledc_set_duty_and_update(LEDC_HIGH_SPEED_MODE, PWM_CHANNEL0, timer_duty0, 0);
-                ledc_set_duty_and_update(LEDC_HIGH_SPEED_MODE, PWM_CHANNEL1, timer_duty1, 0);
-                if(weight < ((float)dispense_amount))
+                complete_cmd(cmd_id, CMD_DONE);
+            }
+            for(ch = 0; ch < NUM_FEED_CHANNELS; ch++)
+            {
+                if(feed_channels[ch].dispense_amount > 0)
                 {
-                    vTaskDelay(2/portTICK_RATE_MS);    
+                    portion.channel = ch;
+                    portion.grams = feed_channels[ch].dispense_amount;
+                    portion.cmd_id = cmd_id;
+                    xQueueSend(portion_queue, (void*)&portion, (TickType_t)0);
                 }
-                else
+            }
+        }
+        
+        if(uxQueueMessagesWaiting(portion_queue))
+        {
+            dispense_active = 1;
+            if(motion_at >= 0)
+            {
+                motion_latency_ms = (uint32_t)((esp_timer_get_time() - motion_at) / 1000);
+                motion_at = -1;
+                queue_tx('l', 0, CMD_OK);
+            }
+            gpio_set_level(SRV_EN, 1);
+            while(xQueueReceive(portion_queue, &portion, (TickType_t)0))
+            {
+                dispense_portion(&portion);
+                //a command is done once its last portion has been dispensed
+                if(!xQueuePeek(portion_queue, &next, (TickType_t)0) || (next.cmd_id != portion.cmd_id))
                 {
-                    break;
+                    complete_cmd(portion.cmd_id, CMD_DONE);
                 }
             }
-            
-            while(weight < ((float)dispense_amount))
-            {
-               delayMicroseconds(100);   
-            }     
-            
-            for (count = SERVO_MAX_DEGREE-39; count >= 0; count-=15) 
+            if(!prewarmed)
             {
-                timer_duty0 = calculate_duty(count,0);
-                timer_duty1 = calculate_duty(SERVO_MAX_DEGREE-39-count,1);
-                ledc_set_duty_and_update(LEDC_HIGH_SPEED_MODE, PWM_CHANNEL0, timer_duty0, 0);
-                vTaskDelay(2/portTICK_RATE_MS);     
+                gpio_set_level(SRV_EN, 0);
             }
-           
-            time_dispense = 0;
-            tx_queue_empty = 0;
-            xQueueSend(tx_queue, (void*)&id, (TickType_t)0);
-            gpio_set_level(SRV_EN, 0);
+            dispense_active = 0;
+            
+            queue_tx('d', 0, CMD_DONE);
         }
         
-        vTaskSuspend(0);
+        //a request that came in while dispensing found this task running and
+        //its vTaskResume() did nothing, so pick it up before suspending
+        if(!time_dispense && !uxQueueMessagesWaiting(portion_queue))
+        {
+            vTaskSuspend(0);
+        }
         //vTaskDelay(1000/portTICK_RATE_MS);
             
     }
@@ -451,32 +1032,28 @@ void dispense_task(void* params)
 
 void weight_task(void* params)
 {
-    char id = 'w';
-    char cycles;
-    char iter;
-    int reading;
+    char mode;
+    uint32_t now;
     
     while(1)
     {
         if(sample_weight)
         {
-            gpio_set_level(WS_EN, 0);
-            reading = 0;
+            mode = sample_weight;
             sample_weight = 0;
-            
-            delayMicroseconds(20);
-            
-            for(iter = 0; iter < 64; iter++)
+            weight_mg = read_weight();
+            now = steady_time();
+            if(bout_update(now, weight_mg, dispense_active))
             {
-                reading += adc1_get_raw((adc1_channel_t)channel);
+                queue_tx('b', 0, CMD_OK);
+            }
+            if(mode == WEIGHT_REQUESTED || ((report_deadband_mg > 0) && (abs(weight_mg - reported_mg) >= report_deadband_mg
+               || (now - reported_at) >= report_interval_s)))
+            {
+                reported_mg = weight_mg;
+                reported_at = now;
+                queue_tx('w', 0, CMD_OK);
             }
-            
-            reading /= 64;
-            weight = ((float)(reading-WS_BASELINE))*WS_GRAMS_PER_COUNT;
-            gpio_set_level(WS_EN, 1);
-            sample_weight = 0;
-            tx_queue_empty = 0;
-            xQueueSend(tx_queue, (void*)&id, (TickType_t)0);        
         }
         
         vTaskSuspend(0);
@@ -489,13 +1066,271 @@ void iot_subscribe_callback_handler(AWS_IoT_Client *pClient, char *topicName, ui
     ESP_LOGI(TAG, "Subscribe callback");
     ESP_LOGI(TAG, "%.*s\t%.*s", topicNameLen, topicName, (int) params->payloadLen, (char *)params->payload);
     
-    char msg[200];
-    strncpy(msg, params->payload, params->payloadLen);
-    strcat(msg, "\0");
+    char msg[RX_MSG_LEN];
+    size_t len = params->payloadLen;
+    //can't happen while RX_MSG_LEN follows the client's buffer; a cut command would never parse or ack
+    if(len >= RX_MSG_LEN)
+    {
+        ESP_LOGE(TAG, "Dropping %d byte message", (int)len);
+        return;
+    }
+    memcpy(msg, params->payload, len);
+    msg[len] = '\0';
     rx_queue_empty = 0;
     xQueueSend(rx_queue, (void*)msg, (TickType_t) 0);
 }
 
+static void add_age(cJSON* msg, cJSON** ages, const char* key, uint32_t now, uint32_t time)
+{
+    if(!now || !time || time == now)
+    {
+        return;
+    }
+    if(*ages == NULL)
+    {
+        *ages = cJSON_CreateObject();
+        cJSON_AddItemToObject(msg, "dt", *ages);
+    }
+    cJSON_AddNumberToObject(*ages, key, now - time);
+}
+
+static int64_t timeval_us(const struct timeval* tv)
+{
+    return (int64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+/* One SNTP request per CLOCK_RESYNC_S. The server's transmit time is taken
+ * as the middle of the round trip; the offset from the local clock over
+ * the time since the previous sync is the drift of the RTC.
+ */
+void clock_task(void* params)
+{
+    struct addrinfo hints;
+    struct addrinfo* server = NULL;
+    struct timeval timeout = {2, 0};
+    struct timeval sent, received, now;
+    uint8_t pkt[48];
+    uint32_t secs, frac;
+    int64_t offset_us;
+    int sock;
+    
+    xEventGroupWaitBits(wifi_event_group, CONNECTED_BIT, false, true, portMAX_DELAY);
+    gettimeofday(&sent, NULL);
+    if(clock_synced_at && (sent.tv_sec - clock_synced_at < CLOCK_RESYNC_S))
+    {
+        vTaskDelete(NULL);
+    }
+    
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    if(getaddrinfo(SNTP_SERVER, SNTP_PORT, &hints, &server) != 0 || server == NULL)
+    {
+        ESP_LOGW(TAG, "Could not resolve %s", SNTP_SERVER);
+        vTaskDelete(NULL);
+    }
+    sock = socket(AF_INET, SOCK_DGRAM, 0);
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    memset(pkt, 0, sizeof(pkt));
+    pkt[0] = 0x1b; //version 3, client mode
+    gettimeofday(&sent, NULL);
+    sendto(sock, pkt, sizeof(pkt), 0, server->ai_addr, server->ai_addrlen);
+    freeaddrinfo(server);
+    if(recv(sock, pkt, sizeof(pkt), 0) < (int)sizeof(pkt) || (pkt[0] & 0x07) != 4)
+    {
+        ESP_LOGW(TAG, "No SNTP reply");
+        close(sock);
+        vTaskDelete(NULL);
+    }
+    gettimeofday(&received, NULL);
+    close(sock);
+    
+    secs = ((uint32_t)pkt[40] << 24) | ((uint32_t)pkt[41] << 16) | ((uint32_t)pkt[42] << 8) | pkt[43];
+    frac = ((uint32_t)pkt[44] << 24) | ((uint32_t)pkt[45] << 16) | ((uint32_t)pkt[46] << 8) | pkt[47];
+    now.tv_sec = secs - NTP_UNIX_OFFSET;
+    now.tv_usec = ((uint64_t)frac * 1000000) >> 32;
+    offset_us = timeval_us(&now) - (timeval_us(&sent) + timeval_us(&received)) / 2;
+    if(clock_synced_at)
+    {
+        //microseconds off per second elapsed is parts per million
+        clock_drift_ppm = offset_us / (sent.tv_sec - clock_synced_at);
+    }
+    clock_offset_ms = offset_us / 1000;
+    
+    gettimeofday(&now, NULL);
+    secs = now.tv_sec;
+    offset_us += timeval_us(&now);
+    now.tv_sec = offset_us / 1000000;
+    now.tv_usec = offset_us % 1000000;
+    settimeofday(&now, NULL);
+    clock_stepped_s += (int32_t)(now.tv_sec - secs);
+    ESP_LOGI(TAG, "Clock synced, offset %d ms, drift %d ppm", clock_offset_ms, clock_drift_ppm);
+    clock_synced_at = now.tv_sec;
+    queue_tx('c', 0, CMD_OK);
+    vTaskDelete(NULL);
+}
+
+static void lan_mac(const uint8_t* buf, size_t len, uint8_t* mac)
+{
+    uint8_t full[32];
+    mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), lan_key, LAN_KEY_LEN, buf, len, full);
+    memcpy(mac, full, LAN_MAC_LEN);
+}
+
+static void lan_send(char type, const char* payload, const struct sockaddr_in* to)
+{
+    uint8_t pkt[LAN_PKT_LEN];
+    size_t id_len = strlen(device_id);
+    size_t len = strlen(payload);
+    
+    if(LAN_HEADER_LEN + id_len + len + LAN_MAC_LEN > LAN_PKT_LEN)
+    {
+        ESP_LOGE(TAG, "LAN payload too long");
+        return;
+    }
+    lan_tx_seq++;
+    if(lan_tx_seq > lan_tx_reserved)
+    {
+        lan_tx_reserved = lan_tx_seq + LAN_SEQ_BLOCK - 1;
+        store_lan_seq("lan_tx_seq", lan_tx_reserved);
+    }
+    pkt[0] = 'P';
+    pkt[1] = 'F';
+    pkt[2] = LAN_VERSION;
+    pkt[3] = type;
+    pkt[4] = lan_tx_seq >> 24;
+    pkt[5] = lan_tx_seq >> 16;
+    pkt[6] = lan_tx_seq >> 8;
+    pkt[7] = lan_tx_seq;
+    pkt[8] = id_len;
+    memcpy(pkt + LAN_HEADER_LEN, device_id, id_len);
+    memcpy(pkt + LAN_HEADER_LEN + id_len, payload, len);
+    len += LAN_HEADER_LEN + id_len;
+    lan_mac(pkt, len, pkt + len);
+    sendto(lan_sock, pkt, len + LAN_MAC_LEN, 0, (const struct sockaddr*)to, sizeof(*to));
+}
+
+/* Commands from a hub on the local network. They go through the same
+ * parser as commands from AWS, and the command id dedupe drops whichever
+ * copy arrives second when the hub falls back to the cloud.
+ */
+void lan_task(void* params)
+{
+    uint8_t pkt[LAN_PKT_LEN];
+    uint8_t mac[LAN_MAC_LEN];
+    char msg[RX_MSG_LEN];
+    char announce[24];
+    struct sockaddr_in addr;
+    socklen_t addr_len;
+    int len, id_len, payload_len, i;
+    uint8_t diff;
+    uint32_t seq;
+    int on = 1;
+    
+    lan_sock = socket(AF_INET, SOCK_DGRAM, 0);
+    setsockopt(lan_sock, SOL_SOCKET, SO_BROADCAST, &on, sizeof(on));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(LAN_PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if(bind(lan_sock, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+    {
+        ESP_LOGE(TAG, "Could not bind LAN port %d", LAN_PORT);
+        vTaskDelete(NULL);
+    }
+    
+    while(1)
+    {
+        addr_len = sizeof(addr);
+        len = recvfrom(lan_sock, pkt, sizeof(pkt), 0, (struct sockaddr*)&addr, &addr_len);
+        if(len < LAN_HEADER_LEN + LAN_MAC_LEN || pkt[0] != 'P' || pkt[1] != 'F' || pkt[2] != LAN_VERSION)
+        {
+            continue;
+        }
+        id_len = pkt[8];
+        payload_len = len - LAN_HEADER_LEN - id_len - LAN_MAC_LEN;
+        if(payload_len < 0 || id_len != strlen(device_id) || memcmp(pkt + LAN_HEADER_LEN, device_id, id_len) != 0)
+        {
+            continue;
+        }
+        lan_mac(pkt, len - LAN_MAC_LEN, mac);
+        for(diff = 0, i = 0; i < LAN_MAC_LEN; i++)
+        {
+            diff |= mac[i] ^ pkt[len - LAN_MAC_LEN + i];
+        }
+        seq = ((uint32_t)pkt[4] << 24) | ((uint32_t)pkt[5] << 16) | ((uint32_t)pkt[6] << 8) | pkt[7];
+        if(diff || seq <= lan_rx_seq)
+        {
+            ESP_LOGW(TAG, "Dropping unauthenticated or replayed LAN packet");
+            continue;
+        }
+        lan_rx_seq = seq;
+        store_lan_seq("lan_rx_seq", seq);
+        lan_hub = addr;
+        lan_hub_known = 1;
+        
+        if(pkt[3] == 'D')
+        {
+            snprintf(announce, sizeof(announce), "{\"d\":%u}", seq);
+            lan_send('A', announce, &addr);
+        }
+        else if((pkt[3] == 'C') && (payload_len < RX_MSG_LEN))
+        {
+            memcpy(msg, pkt + LAN_HEADER_LEN + id_len, payload_len);
+            msg[payload_len] = '\0';
+            rx_queue_empty = 0;
+            xQueueSend(rx_queue, (void*)msg, (TickType_t) 0);
+            //answer on the next loop of the AWS task instead of at the next telemetry period
+            tx_urgent = 1;
+            stay_awake(WAKE_DRAIN_MS);
+        }
+    }
+}
+
+/* Upload unsent records in bulk, as many per publish as the TX buffer takes */
+static void journal_drain(AWS_IoT_Client* client, const char* topic, uint16_t topic_len)
+{
+    static int64_t started = 0;
+    static uint32_t drained = 0, drained_bytes = 0;
+    IoT_Publish_Message_Params params;
+    journal_batch_t batch;
+    int n;
+    
+    if(!journal_pending())
+    {
+        return;
+    }
+    if(!started)
+    {
+        started = esp_timer_get_time();
+    }
+    params.qos = QOS1;
+    params.isRetained = 0;
+    params.payload = (void*)journal_buf;
+    
+    for(n = 0; n < JOURNAL_DRAIN_BATCHES && journal_pending(); n++)
+    {
+        journal_batch(journal_buf, sizeof(journal_buf) - MQTT_PUBLISH_OVERHEAD - topic_len, &batch);
+        params.payloadLen = batch.len;
+        //a batch of only torn or oversized records has nothing to send
+        if(batch.added && aws_iot_mqtt_publish(client, topic, topic_len, &params) != SUCCESS)
+        {
+            return;
+        }
+        journal_commit(&batch);
+        drained += batch.taken;
+        drained_bytes += batch.len;
+    }
+    if(!journal_pending())
+    {
+        ESP_LOGI(TAG, "Journal drained: %u records, %u bytes in %u ms", drained, drained_bytes,
+                 (uint32_t)((esp_timer_get_time() - started) / 1000));
+        started = 0;
+        drained = 0;
+        drained_bytes = 0;
+    }
+}
+
 void disconnectCallbackHandler(AWS_IoT_Client *pClient, void *data) {
     ESP_LOGW(TAG, "MQTT Disconnect");
     IoT_Error_t rc = FAILURE;
@@ -517,16 +1352,38 @@ void disconnectCallbackHandler(AWS_IoT_Client *pClient, void *data) {
     }
 }
 
+/* True once every queued command has been carried out */
+static int tasks_idle(void)
+{
+    return rx_queue_empty && !time_dispense && !sample_weight
+        && !uxQueueMessagesWaiting(portion_queue)
+        && (eTaskGetState(dispense_task_h) == eSuspended)
+        && (eTaskGetState(weight_task_h) == eSuspended);
+}
+
 void aws_iot_task(void *param) {
-    char cPayload[100];
+    char cPayload[TX_MSG_LEN];
 
     //int32_t i = 0;
     cJSON* msg_for_aws = NULL;
     cJSON* msg_for_motion = NULL;
     cJSON* data = NULL;
-    char id;
+    cJSON* acks = NULL;
+    cJSON* ages = NULL;
+    cJSON* bout = NULL;
+    bout_t finished;
+    tx_event_t event;
+    uint32_t now;
     char* str;
     char motion_flag = 0;
+    char connected;
+    int attempt;
+    char online;
+    uint32_t motion_time = 0;
+    struct timeval motion_tv;
+    int64_t motion_age;
+    char sleepy;
+    TickType_t last_tx;
         
 
     IoT_Error_t rc = FAILURE;
@@ -583,107 +1440,244 @@ void aws_iot_task(void *param) {
         abort();
     }
 
-    /* Wait for WiFI to show as connected */
-    xEventGroupWaitBits(wifi_event_group, CONNECTED_BIT,
-                        false, true, portMAX_DELAY);
+    /* Wait for WiFi to show as connected, but not forever: with the access
+     * point or the broker down at wake the device works offline instead,
+     * journals its batches and sleeps as usual, so tx_queue keeps draining.
+     */
+    connected = (xEventGroupWaitBits(wifi_event_group, CONNECTED_BIT,
+                        false, true, WIFI_WAIT_MS / portTICK_RATE_MS) & CONNECTED_BIT) != 0;
+    if(!connected)
+    {
+        ESP_LOGE(TAG, "No WiFi after %d ms, working offline", WIFI_WAIT_MS);
+    }
 
     connectParams.keepAliveIntervalInSec = 10;
-    connectParams.isCleanSession = true;
+    /* Persistent session: the broker keeps the subscription and queues QOS1
+     * commands while the device is in deep sleep, then delivers them on the
+     * next connect. The session is keyed by client ID, so every device uses
+     * its own device id.
+     */
+    connectParams.isCleanSession = false;
     connectParams.MQTTVersion = MQTT_3_1_1;
-    /* Client ID is set in the menuconfig of the example */
-    connectParams.pClientID = CONFIG_AWS_EXAMPLE_CLIENT_ID;
-    connectParams.clientIDLen = (uint16_t) strlen(CONFIG_AWS_EXAMPLE_CLIENT_ID);
+    connectParams.pClientID = device_id;
+    connectParams.clientIDLen = (uint16_t) strlen(device_id);
     connectParams.isWillMsgPresent = false;
 
-    ESP_LOGI(TAG, "Connecting to AWS...");
-    do {
+    for(attempt = 0; connected && attempt < CONNECT_ATTEMPTS; attempt++) {
+        ESP_LOGI(TAG, "Connecting to AWS...");
         rc = aws_iot_mqtt_connect(&client, &connectParams);
-        if(SUCCESS != rc) {
-            ESP_LOGE(TAG, "Error(%d) connecting to %s:%d", rc, mqttInitParams.pHostURL, mqttInitParams.port);
-            vTaskDelay(1000 / portTICK_RATE_MS);
+        if(SUCCESS == rc) {
+            break;
         }
-    } while(SUCCESS != rc);
+        ESP_LOGE(TAG, "Error(%d) connecting to %s:%d", rc, mqttInitParams.pHostURL, mqttInitParams.port);
+        vTaskDelay(1000 / portTICK_RATE_MS);
+    }
+    if(connected && SUCCESS != rc) {
+        ESP_LOGE(TAG, "No broker after %d attempts, working offline", CONNECT_ATTEMPTS);
+        connected = 0;
+    }
 
     /*
      * Enable Auto Reconnect functionality. Minimum and Maximum time of Exponential backoff are set in aws_iot_config.h
      *  #AWS_IOT_MQTT_MIN_RECONNECT_WAIT_INTERVAL
      *  #AWS_IOT_MQTT_MAX_RECONNECT_WAIT_INTERVAL
      */
-    rc = aws_iot_mqtt_autoreconnect_set_status(&client, true);
-    if(SUCCESS != rc) {
-        ESP_LOGE(TAG, "Unable to set Auto Reconnect to true - %d", rc);
-        abort();
+    if(connected) {
+        rc = aws_iot_mqtt_autoreconnect_set_status(&client, true);
+        if(SUCCESS != rc) {
+            ESP_LOGE(TAG, "Unable to set Auto Reconnect to true - %d", rc);
+            abort();
+        }
     }
 
-    const char *TOPIC_PUB = "pet-feeder/to_aws";
-    const char *MOTION_PUB = "pet-feeder/motion";
-    const char* TOPIC_SUB = "pet-feeder/from_aws";
+    char TOPIC_PUB[TOPIC_LEN];
+    char MOTION_PUB[TOPIC_LEN];
+    char TOPIC_SUB[TOPIC_LEN];
+    snprintf(TOPIC_PUB, TOPIC_LEN, "%s/%s/to_aws", TOPIC_PREFIX, device_id);
+    snprintf(MOTION_PUB, TOPIC_LEN, "%s/%s/motion", TOPIC_PREFIX, device_id);
+    snprintf(TOPIC_SUB, TOPIC_LEN, "%s/%s/from_aws", TOPIC_PREFIX, device_id);
     const int TOPIC_PUB_LEN = strlen(TOPIC_PUB);
     const int MOTION_PUB_LEN = strlen(MOTION_PUB);
     const int TOPIC_SUB_LEN = strlen(TOPIC_SUB);
 
-    ESP_LOGI(TAG, "Subscribing...");
-    rc = aws_iot_mqtt_subscribe(&client, TOPIC_SUB, TOPIC_SUB_LEN, QOS0, iot_subscribe_callback_handler, NULL);
-    if(SUCCESS != rc) {
-        ESP_LOGE(TAG, "Error subscribing : %d ", rc);
-        abort();
+    if(connected) {
+        ESP_LOGI(TAG, "Subscribing...");
+        rc = aws_iot_mqtt_subscribe(&client, TOPIC_SUB, TOPIC_SUB_LEN, QOS1, iot_subscribe_callback_handler, NULL);
+        if(SUCCESS != rc) {
+            ESP_LOGE(TAG, "Error subscribing : %d ", rc);
+            abort();
+        }
     }
 
     paramsQOS0.qos = QOS0;
     paramsQOS0.payload = (void *) cPayload;
     paramsQOS0.isRetained = 0;
     
-    while((NETWORK_ATTEMPTING_RECONNECT == rc || NETWORK_RECONNECTED == rc || SUCCESS == rc)) {
+    //no sleep until the commands queued while asleep are drained
+    last_tx = xTaskGetTickCount();
+    stay_awake(WAKE_DRAIN_MS);
+    while(!connected || NETWORK_ATTEMPTING_RECONNECT == rc || NETWORK_RECONNECTED == rc || SUCCESS == rc) {
+
+        //Wait on the socket for up to YIELD_MS; inbound messages are handed
+        //to the subscribe callback as soon as they arrive
+        if(connected)
+        {
+            rc = aws_iot_mqtt_yield(&client, YIELD_MS);
+        }
+        //While the client is reconnecting, or never got through this wake,
+        //telemetry goes to the journal
+        online = connected && (NETWORK_ATTEMPTING_RECONNECT != rc);
+        if(online)
+        {
+            journal_drain(&client, TOPIC_PUB, TOPIC_PUB_LEN);
+        }
+        else
+        {
+            vTaskDelay(YIELD_MS / portTICK_RATE_MS);
+        }
 
-        //Max time the yield function will wait for read messages
-        rc = aws_iot_mqtt_yield(&client, 100);
-        if(NETWORK_ATTEMPTING_RECONNECT == rc) {
-            // If the client is attempting to reconnect we will skip the rest of the loop.
+        //Past the wake window with nothing left to do: publish one last batch and sleep
+        sleepy = ((int32_t)(xTaskGetTickCount() - awake_until) >= 0) && tasks_idle();
+        if(sleepy && prewarmed)
+        {
+            ESP_LOGI(TAG, "No dispense after motion, backing off");
+            disarm();
+        }
+        
+        //Outbound telemetry keeps its own cadence unless something urgent is queued
+        if(!tx_urgent && !sleepy && (xTaskGetTickCount() - last_tx) < (TELEMETRY_PERIOD_MS / portTICK_RATE_MS))
+        {
             continue;
         }
+        last_tx = xTaskGetTickCount();
+        tx_urgent = 0;
 
         ESP_LOGI(TAG, "Stack remaining for task '%s' is %d bytes", pcTaskGetTaskName(NULL), uxTaskGetStackHighWaterMark(NULL));
-        vTaskDelay(5000 / portTICK_RATE_MS);
         
         msg_for_aws = cJSON_CreateObject();
         msg_for_motion = cJSON_CreateObject();
         data = cJSON_CreateNumber(1);
         cJSON_AddItemToObject(msg_for_aws, "heartbeat", data);
+        //records are stamped with the batch time t and their age in seconds
+        //as {"dt": {"weight": 4}} when they are older than that
+        now = wall_time();
+        if(now)
+        {
+            cJSON_AddNumberToObject(msg_for_aws, "t", now);
+        }
         
         
-        while(xQueueReceive(tx_queue, &id, (TickType_t) 1))
+        while(xQueueReceive(tx_queue, &event, (TickType_t) 1))
         {
-            ESP_LOGI(TAG, "Received item in txQueue: %c", id);
-            if(id == 'w')
+            ESP_LOGI(TAG, "Received item in txQueue: %c", event.type);
+            if(event.type == 'w')
             {
-                data = cJSON_CreateNumber(weight);
+                data = cJSON_CreateNumber(weight_mg / 1000.0);
                 cJSON_AddItemToObject(msg_for_aws, "weight", data); 
+                add_age(msg_for_aws, &ages, "weight", now, event.time);
             }
-            else if(id == 'd')
+            else if(event.type == 'd')
             {
                 data = cJSON_CreateString("ready");
                 cJSON_AddItemToObject(msg_for_aws, "status", data);
+                add_age(msg_for_aws, &ages, "status", now, event.time);
+            }
+            else if(event.type == 'l')
+            {
+                cJSON_AddNumberToObject(msg_for_aws, "motion_ms", motion_latency_ms);
+            }
+            //finished bouts as [{"ago": 40, "len": 150, "g": 12.5, "peak": 6.2}, ...],
+            //ago is seconds from the end of the bout to this batch
+            else if(event.type == 'b' && bouts_pending())
+            {
+                data = cJSON_CreateArray();
+                cJSON_AddItemToObject(msg_for_aws, "bouts", data);
+                while(bout_next(&finished))
+                {
+                    bout = cJSON_CreateObject();
+                    cJSON_AddNumberToObject(bout, "ago", steady_time() - finished.end);
+                    cJSON_AddNumberToObject(bout, "len", finished.end - finished.start);
+                    cJSON_AddNumberToObject(bout, "g", finished.mg / 1000.0);
+                    cJSON_AddNumberToObject(bout, "peak", finished.peak_rate / 1000.0);
+                    cJSON_AddItemToArray(data, bout);
+                }
             }
-            else if(id == 'm')
+            else if(event.type == 'c')
+            {
+                data = cJSON_CreateObject();
+                cJSON_AddNumberToObject(data, "offset_ms", clock_offset_ms);
+                cJSON_AddNumberToObject(data, "drift_ppm", clock_drift_ppm);
+                cJSON_AddItemToObject(msg_for_aws, "clock", data);
+            }
+            else if(event.type == 'm')
             {
                 data = cJSON_CreateNumber(1);
                 cJSON_AddItemToObject(msg_for_motion, "motion", data);
+                //t to the ms, the camera and gate time their decision from it
+                if(event.time)
+                {
+                    gettimeofday(&motion_tv, NULL);
+                    motion_age = motion_at >= 0 ? esp_timer_get_time() - motion_at : 0;
+                    cJSON_AddNumberToObject(msg_for_motion, "t", motion_tv.tv_sec + (motion_tv.tv_usec - motion_age) / 1e6);
+                }
+                motion_time = event.time;
                 motion_flag = 1;
             }
+            //acks are batched as [{"id":7,"result":"done"}, ...]
+            else if(event.type == 'a')
+            {
+                if(acks == NULL)
+                {
+                    acks = cJSON_CreateArray();
+                    cJSON_AddItemToObject(msg_for_aws, "ack", acks);
+                }
+                data = cJSON_CreateObject();
+                cJSON_AddNumberToObject(data, "id", event.cmd_id);
+                cJSON_AddStringToObject(data, "result", cmd_result_str[event.result]);
+                if(now && event.time && event.time != now)
+                {
+                    cJSON_AddNumberToObject(data, "dt", now - event.time);
+                }
+                cJSON_AddItemToArray(acks, data);
+            }
         }
         
         tx_queue_empty = 1;
         
-        str = cJSON_Print(msg_for_aws);
-        snprintf(cPayload, 100, "%s", str);
+        //offline, motion is only worth keeping as a record in the batch
+        if(motion_flag && !online)
+        {
+            motion_flag = 0;
+            cJSON_AddNumberToObject(msg_for_aws, "motion", 1);
+            add_age(msg_for_aws, &ages, "motion", now, motion_time);
+        }
+        
+        acks = NULL;
+        ages = NULL;
+        str = cJSON_PrintUnformatted(msg_for_aws);
+        snprintf(cPayload, TX_MSG_LEN, "%s", str);
+        free(str);
         paramsQOS0.payloadLen = strlen(cPayload);
-        rc = aws_iot_mqtt_publish(&client, TOPIC_PUB, TOPIC_PUB_LEN, &paramsQOS0);
+        //a hub that answered during this wake gets the telemetry directly
+        if(lan_hub_known)
+        {
+            lan_send('T', cPayload, &lan_hub);
+        }
+        else if(!online)
+        {
+            journal_append(cPayload);
+        }
+        else
+        {
+            rc = aws_iot_mqtt_publish(&client, TOPIC_PUB, TOPIC_PUB_LEN, &paramsQOS0);
+        }
         
         if(motion_flag)
         {
             motion_flag = 0;
-            str = cJSON_Print(msg_for_motion);
-            snprintf(cPayload, 100, "%s", str);
+            str = cJSON_PrintUnformatted(msg_for_motion);
+            snprintf(cPayload, TX_MSG_LEN, "%s", str);
+            free(str);
             paramsQOS0.payloadLen = strlen(cPayload);
             rc = aws_iot_mqtt_publish(&client, MOTION_PUB, MOTION_PUB_LEN, &paramsQOS0);
         }
@@ -696,7 +1690,7 @@ void aws_iot_task(void *param) {
             rc = SUCCESS;
         }
         
-        if(tx_queue_empty && rx_queue_empty)
+        if(sleepy && tx_queue_empty)
         {
             esp_deep_sleep_start();
         }
@@ -720,6 +1714,13 @@ static void initialise_wifi(void)
             .password = EXAMPLE_WIFI_PASS,
         },
     };
+    //after deep sleep go straight to the last access point instead of scanning
+    if(ap_channel)
+    {
+        wifi_config.sta.bssid_set = true;
+        memcpy(wifi_config.sta.bssid, ap_bssid, sizeof(ap_bssid));
+        wifi_config.sta.channel = ap_channel;
+    }
     ESP_LOGI(TAG, "Setting WiFi configuration SSID %s...", wifi_config.sta.ssid);
     ESP_ERROR_CHECK( esp_wifi_set_mode(WIFI_MODE_STA) );
     ESP_ERROR_CHECK( esp_wifi_set_config(WIFI_IF_STA, &wifi_config) );
@@ -736,15 +1737,23 @@ void app_main()
         err = nvs_flash_init();
     }
     ESP_ERROR_CHECK( err );
+    load_device_id();
+    load_lan_key();
+    journal_open();
+    ESP_LOGI(TAG, "Device id %s, LAN control %s", device_id, lan_enabled ? "on" : "off");
+    
+    //start associating now so WiFi comes up while the peripherals are configured
+    initialise_wifi();
     
-    rx_queue = xQueueCreate(5, 200*sizeof(char));
-    tx_queue = xQueueCreate(10, sizeof(char));
+    rx_queue = xQueueCreate(5, RX_MSG_LEN*sizeof(char));
+    tx_queue = xQueueCreate(10, sizeof(tx_event_t));
+    portion_queue = xQueueCreate(PORTION_QUEUE_LEN, sizeof(portion_t));
     
     if(rx_queue == 0)
     {
         ESP_LOGE(TAG, "Failed to create message queue");
     }
-
+    
     //configure high speed PWM timer
     timer_conf.duty_resolution = LEDC_TIMER_15_BIT;
     timer_conf.freq_hz = 50;
@@ -805,7 +1814,15 @@ void app_main()
     
     gpio_set_level(WS_EN, 1);
     gpio_set_level(SRV_EN, 0);
-
+    
+    //the edge that woke the device came before the ISR was installed
+    if(esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_EXT1)
+    {
+        ESP_LOGI(TAG, "Woken by motion");
+        prewarm();
+        queue_tx('m', 0, CMD_OK);
+    }
+    
     
     //create a queue to handle gpio event from isr
     interrupt_queue = xQueueCreate(10, sizeof(uint32_t));
@@ -822,14 +1839,20 @@ void app_main()
     }
     
 	heartbeat_timer = xTimerCreate("heartbeat_timer", pdMS_TO_TICKS(900000), pdTRUE, (void*) 0, heartbeat_timeout);
-
-    initialise_wifi();
+    
     xTaskCreatePinnedToCore(&aws_iot_task, "aws_iot_task", 9516, NULL, 5, NULL, 1);
     
     ESP_LOGI(TAG, "Creating JSON parsing task");
     xTaskCreate(&parse_json, "parse_json_task", 5000, NULL, 4, NULL);
     xTaskCreate(&motion_task, "motion_task", 2500, NULL, 3, NULL);
+    xTaskCreate(&clock_task, "clock_task", 3072, NULL, 1, NULL);
+    if(lan_enabled)
+    {
+        xTaskCreate(&lan_task, "lan_task", 4096, NULL, 4, NULL);
+    }
     
+    //weighed on every wake for the bout segmenter
+    sample_weight = WEIGHT_CHECK;
     xTaskCreate(&dispense_task, "dispenser_task", 5000, NULL, 2, &dispense_task_h);
     xTaskCreate(&weight_task, "weight_task", 5000, NULL, 2, &weight_task_h);
     
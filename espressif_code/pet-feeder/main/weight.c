@@ -0,0 +1,41 @@
+/**
+ * @file weight.c
+ * @brief Fixed-point load cell calibration.
+ *
+ * A reading is converted as (reading - WS_BASELINE) * WS_MG_PER_COUNT_Q12,
+ * rounded to the nearest milligram. test/ checks it against the floating
+ * point calibration for every reading the ADC can return.
+ */
+
+#include <stdint.h>
+
+#include "weight.h"
+
+#define WS_BASELINE 1077
+#define WS_MG_PER_COUNT_Q12 198905 //48.5608 mg per ADC count in Q12
+
+/* reading is the averaged raw ADC value, 0..WS_READING_MAX. The product
+ * fits 32 bits for any of them, with room for readings to about 11800. */
+int32_t weight_mg(int reading)
+{
+    return ((reading - WS_BASELINE) * WS_MG_PER_COUNT_Q12 + (1 << 11)) >> 12;
+}
+
+/* Grams from a JSON number, saturated so that no value a message can hold
+ * overflows the conversion */
+int32_t mg_from_grams(double grams)
+{
+    if(grams != grams)
+    {
+        return 0;
+    }
+    if(grams >= INT32_MAX / 1000.0)
+    {
+        return INT32_MAX;
+    }
+    if(grams <= INT32_MIN / 1000.0)
+    {
+        return INT32_MIN;
+    }
+    return (int32_t)(grams * 1000);
+}
@@ -0,0 +1,18 @@
+/**
+ * @file weight.h
+ * @brief Load cell readings to integer milligrams.
+ *
+ * Weights stay in int32_t milligrams from the ADC through the control path;
+ * grams only appear at the JSON boundary, and mg_from_grams is the one way in.
+ */
+#ifndef WEIGHT_H
+#define WEIGHT_H
+
+#include <stdint.h>
+
+#define WS_READING_MAX 4095 //12 bit ADC
+
+int32_t weight_mg(int reading);
+int32_t mg_from_grams(double grams);
+
+#endif
@@ -0,0 +1,7 @@
+/* Host stand-in: RTC memory is plain memory */
+#ifndef ESP_ATTR_H
+#define ESP_ATTR_H
+
+#define RTC_DATA_ATTR
+
+#endif
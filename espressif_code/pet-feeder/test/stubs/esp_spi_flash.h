@@ -0,0 +1,7 @@
+/* Host stand-in */
+#ifndef ESP_SPI_FLASH_H
+#define ESP_SPI_FLASH_H
+
+#define SPI_FLASH_SEC_SIZE 4096
+
+#endif
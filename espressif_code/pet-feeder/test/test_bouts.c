@@ -0,0 +1,158 @@
+/**
+ * @file test_bouts.c
+ * @brief Runs the bout segmenter over weight traces.
+ *
+ * Every <name>.trace given on the command line holds "t mg" per sample and
+ * comes with <name>.bouts, the bouts server/src/bouts.py finds in it as
+ * "start end mg peak_rate"; the firmware has to find exactly the same.
+ * New traces, recorded ones included, are written by bouts.py -x.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../main/bouts.c"
+
+#define MAX_BOUTS 64
+
+/* Deep sleep keeps the RTC state, a power cycle loses it */
+static void power_cycle(void)
+{
+    memset(&seg, 0, sizeof(seg));
+    bouts_head = 0;
+    bouts_tail = 0;
+}
+
+static int read_bouts(const char* path, bout_t* expect)
+{
+    FILE* f = fopen(path, "r");
+    int n = 0;
+    
+    assert(f != NULL);
+    while(n < MAX_BOUTS && fscanf(f, "%u %u %d %d", &expect[n].start, &expect[n].end, &expect[n].mg, &expect[n].peak_rate) == 4)
+    {
+        n++;
+    }
+    fclose(f);
+    return n;
+}
+
+static int run_trace(const char* trace)
+{
+    static bout_t found[MAX_BOUTS], expect[MAX_BOUTS];
+    char path[512];
+    FILE* f;
+    uint32_t t;
+    int32_t mg;
+    int n = 0, expected, i, samples = 0;
+    size_t len = strlen(trace);
+    
+    assert(len > 6 && strcmp(trace + len - 6, ".trace") == 0 && len < sizeof(path));
+    snprintf(path, sizeof(path), "%.*s.bouts", (int)(len - 6), trace);
+    expected = read_bouts(path, expect);
+    
+    power_cycle();
+    f = fopen(trace, "r");
+    assert(f != NULL);
+    while(fscanf(f, "%u %d", &t, &mg) == 2)
+    {
+        samples++;
+        if(bout_update(t, mg, 0))
+        {
+            //published as soon as it is finished
+            assert(bout_next(&found[n]));
+            assert(++n < MAX_BOUTS);
+        }
+        assert(!bouts_pending());
+    }
+    fclose(f);
+    
+    for(i = 0; i < n && i < expected; i++)
+    {
+        if(memcmp(&found[i], &expect[i], sizeof(bout_t)) != 0)
+        {
+            break;
+        }
+    }
+    if(i < n || i < expected)
+    {
+        printf("%s: bout %d differs, found %u %u %d %d, bouts.py %u %u %d %d\n", trace, i,
+               i < n ? found[i].start : 0, i < n ? found[i].end : 0, i < n ? found[i].mg : 0, i < n ? found[i].peak_rate : 0,
+               i < expected ? expect[i].start : 0, i < expected ? expect[i].end : 0,
+               i < expected ? expect[i].mg : 0, i < expected ? expect[i].peak_rate : 0);
+        return 1;
+    }
+    printf("%s: ok, %d samples, %d bouts\n", trace, samples, n);
+    return 0;
+}
+
+/* Bouts that are not published in time push the oldest out of the queue */
+static void test_queue_keeps_newest(void)
+{
+    bout_t b;
+    uint32_t t = 0;
+    int32_t w = 100000;
+    int i, k, closed = 0;
+    
+    power_cycle();
+    bout_update(t, w, 0);
+    for(i = 0; i < BOUT_QUEUE + 2; i++)
+    {
+        //eat 5 g over a minute, then leave the bowl alone
+        for(k = 0; k < 6; k++)
+        {
+            t += 10;
+            w -= 1000;
+            closed += bout_update(t, w, 0);
+        }
+        for(k = 0; k < 10; k++)
+        {
+            t += 10;
+            closed += bout_update(t, w, 0);
+        }
+    }
+    assert(closed == BOUT_QUEUE + 2);
+    for(i = 0; bout_next(&b); i++)
+    {
+        assert(b.mg >= 2000);
+    }
+    assert(i == BOUT_QUEUE && b.end > 4 * 160);
+    printf("queue keeps newest: ok\n");
+}
+
+/* A dispense in the middle of a bout ends it, the food is not eaten */
+static void test_dispense_ends_bout(void)
+{
+    bout_t b;
+    uint32_t t = 0;
+    int32_t w = 50000;
+    int k;
+    
+    power_cycle();
+    bout_update(t, w, 0);
+    for(k = 0; k < 6; k++)
+    {
+        t += 10;
+        w -= 1500;
+        assert(!bout_update(t, w, 0));
+    }
+    assert(bout_update(t + 10, w + 40000, 1));
+    assert(bout_next(&b) && b.mg == 9000 && b.end == t);
+    //and the level starts over from the dispensed weight
+    assert(!bout_update(t + 20, w + 40000, 0) && !bouts_pending());
+    printf("dispense ends bout: ok\n");
+}
+
+int main(int argc, char** argv)
+{
+    int i, failed = 0;
+    
+    test_queue_keeps_newest();
+    test_dispense_ends_bout();
+    for(i = 1; i < argc; i++)
+    {
+        failed |= run_trace(argv[i]);
+    }
+    return failed;
+}
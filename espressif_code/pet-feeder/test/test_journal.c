@@ -0,0 +1,302 @@
+/**
+ * @file test_journal.c
+ * @brief Drains the telemetry journal from a simulated flash partition.
+ *
+ * The flash behaves like NOR: erasing sets a sector to 0xff and writing can
+ * only clear bits. A write budget cuts writes short to simulate a power loss,
+ * and a power cycle forgets the RTC state so the journal is scanned again.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../main/journal.c"
+
+#define FLASH_SIZE (64 * 1024) //as in partitions.csv
+#define TX_BUF_LEN 2048 //CONFIG_AWS_IOT_MQTT_TX_BUF_LEN in sdkconfig
+#define OLD_TX_BUF_LEN 512
+#define TOPIC_LEN 33 //pet-feeder/<12 hex digits>/to_aws
+#define PAYLOAD_LEN(tx_buf) ((tx_buf) - 9 - TOPIC_LEN)
+#define RECORD_MAX 511 //TX_MSG_LEN less the terminator
+
+static uint8_t flash[FLASH_SIZE];
+static uint32_t erases[FLASH_SIZE / SPI_FLASH_SEC_SIZE];
+static long write_budget = -1; //bytes still written before the power fails, -1 for no limit
+static const esp_partition_t partition = {FLASH_SIZE};
+
+const esp_partition_t* esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype, const char* label)
+{
+    (void)type;
+    (void)subtype;
+    (void)label;
+    return &partition;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t* part, size_t offset, void* dst, size_t size)
+{
+    assert(part == &partition && offset + size <= FLASH_SIZE);
+    memcpy(dst, flash + offset, size);
+    return 0;
+}
+
+esp_err_t esp_partition_write(const esp_partition_t* part, size_t offset, const void* src, size_t size)
+{
+    size_t i;
+    
+    assert(part == &partition && offset + size <= FLASH_SIZE);
+    for(i = 0; i < size && write_budget != 0; i++)
+    {
+        flash[offset + i] &= ((const uint8_t*)src)[i];
+        if(write_budget > 0)
+        {
+            write_budget--;
+        }
+    }
+    return 0;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t* part, size_t offset, size_t size)
+{
+    assert(part == &partition && offset % SPI_FLASH_SEC_SIZE == 0 && size % SPI_FLASH_SEC_SIZE == 0);
+    assert(offset + size <= FLASH_SIZE);
+    memset(flash + offset, 0xff, size);
+    for(; size; size -= SPI_FLASH_SEC_SIZE, offset += SPI_FLASH_SEC_SIZE)
+    {
+        erases[offset / SPI_FLASH_SEC_SIZE]++;
+    }
+    return 0;
+}
+
+static void erase_chip(void)
+{
+    memset(flash, 0xff, sizeof(flash));
+    memset(erases, 0, sizeof(erases));
+    write_budget = -1;
+}
+
+/* Deep sleep keeps the RTC state, a power cycle loses it */
+static void power_cycle(void)
+{
+    write_budget = -1;
+    memset(&journal, 0, sizeof(journal));
+    journal_part = NULL;
+    journal_open();
+}
+
+/* A record of exactly len bytes numbered n */
+static void append(uint32_t n, size_t len)
+{
+    char rec[RECORD_MAX + 1];
+    int head = snprintf(rec, sizeof(rec), "{\"n\":%u,\"p\":\"", n);
+    
+    assert(len >= (size_t)head + 2 && len <= RECORD_MAX);
+    memset(rec + head, 'x', len - head - 2);
+    strcpy(rec + len - 2, "\"}");
+    journal_append(rec);
+}
+
+static uint32_t lengths(uint32_t n)
+{
+    //spread over 20..RECORD_MAX, with the largest coming up every so often
+    return n % 7 == 3 ? RECORD_MAX : 20 + (n * 2654435761u) % (RECORD_MAX - 20);
+}
+
+/* Upload everything as the firmware would, checking every payload on the
+ * way. Records come back in seen[] in order; returns how many. */
+static uint32_t drain(size_t size, uint32_t* seen, uint32_t max)
+{
+    static char buf[TX_BUF_LEN];
+    journal_batch_t batch;
+    uint32_t count = 0, passes = 0;
+    const char* p;
+    
+    while(journal_pending())
+    {
+        //every pass makes progress, the journal can't get stuck
+        assert(++passes <= FLASH_SIZE);
+        journal_batch(buf, size, &batch);
+        assert(batch.taken > 0);
+        assert(batch.len <= size);
+        assert(memcmp(buf, JOURNAL_OPEN, strlen(JOURNAL_OPEN)) == 0);
+        assert(memcmp(buf + batch.len - strlen(JOURNAL_CLOSE), JOURNAL_CLOSE, strlen(JOURNAL_CLOSE)) == 0);
+        buf[batch.len] = '\0';
+        for(p = strstr(buf, "{\"n\":"); p != NULL; p = strstr(p + 1, "{\"n\":"))
+        {
+            assert(count < max);
+            seen[count++] = strtoul(p + 5, NULL, 10);
+        }
+        journal_commit(&batch);
+    }
+    return count;
+}
+
+static void test_drains_in_order(void)
+{
+    static uint32_t seen[200];
+    uint32_t n;
+    
+    erase_chip();
+    power_cycle();
+    assert(journal_pending() == 0);
+    for(n = 0; n < 100; n++)
+    {
+        append(n, lengths(n));
+    }
+    assert(journal_pending() == 100);
+    assert(drain(PAYLOAD_LEN(TX_BUF_LEN), seen, 200) == 100);
+    for(n = 0; n < 100; n++)
+    {
+        assert(seen[n] == n);
+    }
+    //uploaded records stay uploaded after a power cycle
+    power_cycle();
+    assert(journal_pending() == 0);
+    printf("drains in order: ok\n");
+}
+
+/* With the old 512 byte TX buffer the largest records can never be sent:
+ * they are dropped and the rest still drains */
+static void test_oversized_records_skipped(void)
+{
+    static uint32_t seen[200];
+    uint32_t n, count, expect = 0;
+    size_t size = PAYLOAD_LEN(OLD_TX_BUF_LEN);
+    
+    erase_chip();
+    power_cycle();
+    for(n = 0; n < 100; n++)
+    {
+        append(n, lengths(n));
+    }
+    count = drain(size, seen, 200);
+    for(n = 0; n < 100; n++)
+    {
+        if(strlen(JOURNAL_OPEN) + lengths(n) + strlen(JOURNAL_CLOSE) <= size)
+        {
+            assert(seen[expect++] == n);
+        }
+    }
+    assert(count == expect && count < 100);
+    printf("oversized records skipped: ok, %u of 100 fit\n", count);
+}
+
+/* A publish that fails leaves the batch to be taken again */
+static void test_failed_publish_retried(void)
+{
+    static char first[TX_BUF_LEN], again[TX_BUF_LEN];
+    journal_batch_t a, b;
+    uint32_t n;
+    
+    erase_chip();
+    power_cycle();
+    for(n = 0; n < 20; n++)
+    {
+        append(n, 200);
+    }
+    journal_batch(first, PAYLOAD_LEN(TX_BUF_LEN), &a);
+    journal_batch(again, PAYLOAD_LEN(TX_BUF_LEN), &b);
+    assert(a.len == b.len && a.taken == b.taken && memcmp(first, again, a.len) == 0);
+    assert(journal_pending() == 20);
+    journal_commit(&b);
+    assert(journal_pending() == 20 - b.taken);
+    printf("failed publish retried: ok\n");
+}
+
+static void test_power_cycle_mid_drain(void)
+{
+    static char buf[TX_BUF_LEN];
+    static uint32_t seen[100];
+    journal_batch_t batch;
+    uint32_t n, count;
+    
+    erase_chip();
+    power_cycle();
+    for(n = 0; n < 50; n++)
+    {
+        append(n, lengths(n));
+    }
+    journal_batch(buf, PAYLOAD_LEN(TX_BUF_LEN), &batch);
+    journal_commit(&batch);
+    power_cycle();
+    assert(journal_pending() == 50 - batch.taken);
+    count = drain(PAYLOAD_LEN(TX_BUF_LEN), seen, 100);
+    assert(count == 50 - batch.taken);
+    for(n = 0; n < count; n++)
+    {
+        assert(seen[n] == batch.taken + n);
+    }
+    printf("power cycle mid drain: ok\n");
+}
+
+/* Appending well past the partition size drops whole sectors from the
+ * oldest end and wears the sectors evenly */
+static void test_full_log_wraps(void)
+{
+    static uint32_t seen[1000];
+    uint32_t n, count, pending, lo = UINT32_MAX, hi = 0, s;
+    
+    erase_chip();
+    power_cycle();
+    for(n = 0; n < 1000; n++)
+    {
+        append(n, 480);
+        if(n == 500)
+        {
+            //and keeps its place across a power cycle while wrapped
+            power_cycle();
+        }
+    }
+    pending = journal_pending();
+    assert(pending > 100 && pending < 1000);
+    count = drain(PAYLOAD_LEN(TX_BUF_LEN), seen, 1000);
+    assert(count == pending);
+    for(n = 0; n < count; n++)
+    {
+        assert(seen[n] == 1000 - count + n);
+    }
+    for(s = 0; s < FLASH_SIZE / SPI_FLASH_SEC_SIZE; s++)
+    {
+        lo = erases[s] < lo ? erases[s] : lo;
+        hi = erases[s] > hi ? erases[s] : hi;
+    }
+    assert(hi - lo <= 1);
+    printf("full log wraps: ok, newest %u kept, %u to %u erases per sector\n", count, lo, hi);
+}
+
+/* A record torn by a power loss is passed over, the ones around it are not */
+static void test_torn_record(void)
+{
+    static uint32_t seen[100];
+    uint32_t n;
+    
+    erase_chip();
+    power_cycle();
+    for(n = 0; n < 10; n++)
+    {
+        append(n, 100);
+    }
+    write_budget = sizeof(journal_record_t) + 50;
+    append(10, 100);
+    power_cycle();
+    append(11, 100);
+    assert(journal_pending() == 12);
+    assert(drain(PAYLOAD_LEN(TX_BUF_LEN), seen, 100) == 11);
+    for(n = 0; n < 10; n++)
+    {
+        assert(seen[n] == n);
+    }
+    assert(seen[10] == 11);
+    printf("torn record: ok\n");
+}
+
+int main(void)
+{
+    test_drains_in_order();
+    test_oversized_records_skipped();
+    test_failed_publish_retried();
+    test_power_cycle_mid_drain();
+    test_full_log_wraps();
+    test_torn_record();
+    return 0;
+}
@@ -0,0 +1,86 @@
+/**
+ * @file test_weight.c
+ * @brief Checks the fixed-point weight conversion against floating point.
+ *
+ * The reference is the calibration the firmware used in float, 0.0485608 g
+ * per count above the baseline. Every reading the ADC can return has to
+ * come out within half a milligram of it, plus what the Q12 constant loses.
+ */
+
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+
+#include "../main/weight.c"
+
+#define G_PER_COUNT 0.0485608
+#define SAMPLES 64 //summed by read_weight before averaging
+
+static double reference_mg(int reading)
+{
+    return (reading - WS_BASELINE) * G_PER_COUNT * 1000;
+}
+
+static void test_full_range(void)
+{
+    //rounding plus half a Q12 step per count the constant may be off by
+    double slack = 0.5 + 0.5 / 4096 * WS_READING_MAX;
+    double err, worst = 0;
+    int reading, exact = 0;
+    
+    for(reading = 0; reading <= WS_READING_MAX; reading++)
+    {
+        err = fabs(weight_mg(reading) - reference_mg(reading));
+        assert(err <= slack);
+        worst = err > worst ? err : worst;
+        exact += weight_mg(reading) == (int32_t)floor(reference_mg(reading) + 0.5);
+    }
+    //steps of one count, nothing lost or doubled up
+    for(reading = 1; reading <= WS_READING_MAX; reading++)
+    {
+        err = weight_mg(reading) - weight_mg(reading - 1);
+        assert(err == 48 || err == 49);
+    }
+    assert(weight_mg(WS_BASELINE) == 0);
+    printf("full range: ok, worst %.4f mg, %d of %d rounded as in float\n", worst, exact, WS_READING_MAX + 1);
+}
+
+/* The int32_t product and the 64 sample sum stay in range */
+static void test_overflow_limits(void)
+{
+    int64_t hi = (int64_t)(WS_READING_MAX - WS_BASELINE) * WS_MG_PER_COUNT_Q12 + (1 << 11);
+    int64_t lo = (int64_t)(0 - WS_BASELINE) * WS_MG_PER_COUNT_Q12 + (1 << 11);
+    int64_t top = (INT32_MAX - (1 << 11)) / WS_MG_PER_COUNT_Q12 + WS_BASELINE;
+    
+    assert(hi <= INT32_MAX && lo >= INT32_MIN);
+    assert((int64_t)WS_READING_MAX * SAMPLES <= INT32_MAX);
+    //the largest reading that fits is still within a milligram, one past it overflows
+    assert(top > WS_READING_MAX);
+    assert(fabs(weight_mg(top) - reference_mg(top)) <= 1);
+    assert((top + 1 - WS_BASELINE) * (int64_t)WS_MG_PER_COUNT_Q12 + (1 << 11) > INT32_MAX);
+    printf("overflow limits: ok, readings up to %d fit, %.1fx headroom\n", (int)top, (double)INT32_MAX / hi);
+}
+
+/* Grams from JSON saturate instead of overflowing */
+static void test_grams(void)
+{
+    assert(mg_from_grams(0) == 0);
+    assert(mg_from_grams(2.5) == 2500);
+    assert(mg_from_grams(0.0485608) == 48);
+    assert(mg_from_grams(-1.5) == -1500);
+    assert(mg_from_grams(2147483.0) == 2147483000);
+    assert(mg_from_grams(2147484.0) == INT32_MAX);
+    assert(mg_from_grams(1e300) == INT32_MAX);
+    assert(mg_from_grams(-1e300) == INT32_MIN);
+    assert(mg_from_grams(INFINITY) == INT32_MAX);
+    assert(mg_from_grams(NAN) == 0);
+    printf("grams: ok\n");
+}
+
+int main(void)
+{
+    test_full_range();
+    test_overflow_limits();
+    test_grams();
+    return 0;
+}
@@ -0,0 +1,231 @@
+#!/usr/bin/env python3
+
+"""
+Eating bout segmentation, as done on the feeder.
+
+The firmware weighs the bowl on every wake and segments the weight stream
+into eating bouts (start, end, grams eaten, peak rate) with a one-sided
+CUSUM of the drop below the resting level; only the bout summaries are
+published, as {"bouts": [{"ago": s, "len": s, "g": grams, "peak": g/min}]}.
+BoutSegmenter mirrors the firmware (espressif_code/pet-feeder/main/bouts.c)
+step for step, in the same integer milligrams, so the detector can be tuned
+on a host: against synthetic days with known bouts, and against weight
+series recorded in the telemetry store.
+	./bouts.py
+	./bouts.py ../telemetry
+
+With -x the traces are written out instead, as <name>.trace ("t mg" per
+sample) and <name>.bouts ("start end mg peak_rate" per bout found here),
+for the firmware's host test to check the C segmenter against:
+	./bouts.py ../telemetry -x ../../espressif_code/pet-feeder/test/traces
+	./bouts.py -n 3 -x ../../espressif_code/pet-feeder/test/traces
+"""
+
+import math
+import os
+import random
+import time
+
+from tsdb import TimeSeriesStore
+
+BOUT_K_MG = 1000
+BOUT_H_MG = 4000
+BOUT_LEVEL_DIV = 20
+BOUT_REFILL_MG = 5000
+BOUT_QUIET_S = 60
+BOUT_MIN_MG = 2000
+
+
+def cdiv(a, b):
+	# C integer division truncates towards zero
+	q = abs(a) // abs(b)
+	return q if (a < 0) == (b < 0) else -q
+
+
+class Bout:
+
+	def __init__(self, start, end, grams, peak_rate):
+		self.start = start
+		self.end = end
+		self.grams = grams
+		self.peak_rate = peak_rate
+
+
+class BoutSegmenter:
+
+	def __init__(self):
+		self.primed = False
+		self.active = False
+		self.level = 0
+		self.cusum = 0
+		self.onset = 0
+		self.low = 0
+		self.low_at = 0
+		self.peak_rate = 0
+		self.bouts = []
+
+	def close(self, rest):
+		# rest is the weight the bowl settled at; the lowest sample is biased
+		# low by the noise
+		self.active = False
+		mg = self.level - rest
+		if(mg >= BOUT_MIN_MG):
+			self.bouts.append(Bout(self.onset, self.low_at, mg / 1000, self.peak_rate / 1000))
+
+	def update(self, t, w, dispensing=False):
+		# w in milligrams
+		if(not self.primed or dispensing or w > self.level + BOUT_REFILL_MG):
+			if(self.active):
+				self.close(self.low)
+			self.primed = True
+			self.level = w
+			self.cusum = 0
+			return
+
+		if(self.active):
+			if(w < self.low):
+				self.peak_rate = max(self.peak_rate, cdiv((self.low - w) * 60, max(t - self.low_at, 1)))
+				self.low = w
+				self.low_at = t
+			elif(t - self.low_at >= BOUT_QUIET_S):
+				self.close(w)
+				self.level = w
+				self.cusum = 0
+			return
+
+		if(self.cusum == 0):
+			self.onset = t
+		self.cusum += self.level - w - BOUT_K_MG
+		if(self.cusum <= 0):
+			self.cusum = 0
+			self.level += cdiv(w - self.level, BOUT_LEVEL_DIV)
+		elif(self.cusum >= BOUT_H_MG):
+			self.active = True
+			self.low = w
+			self.low_at = t
+			self.peak_rate = cdiv((self.level - w) * 60, max(t - self.onset, 1))
+
+
+def to_mg(w):
+	# read_weight() rounds half up to the milligram
+	return math.floor(w * 1000 + 0.5)
+
+
+def segment(times, values):
+	seg = BoutSegmenter()
+	for (t, w) in zip(times, values):
+		seg.update(int(t), to_mg(w))
+	return seg.bouts
+
+
+def export(directory, name, times, values):
+	with open(os.path.join(directory, name + '.trace'), 'w') as f:
+		for (t, w) in zip(times, values):
+			f.write("{} {}\n".format(int(t), to_mg(w)))
+	with open(os.path.join(directory, name + '.bouts'), 'w') as f:
+		for b in segment(times, values):
+			f.write("{} {} {} {}\n".format(b.start, b.end, round(b.grams * 1000), round(b.peak_rate * 1000)))
+
+
+def meal_windows(times, values, length=7200):
+	# The two hours after each meal of a synthetic day, with times from 0,
+	# which is where the bouts are and keeps a trace small
+	start = times[0]
+	keep = [i for (i, t) in enumerate(times) if any(0 <= t - start - meal < length for meal in (8 * 3600, 18 * 3600))]
+	return ([times[i] - start for i in keep], [values[i] for i in keep])
+
+
+def synthetic_day(period=5, noise=0.5, drift=-0.2):
+	"""Returns (times, values, bouts): a day of samples every `period` s with
+	two meals dispensed, a few bouts of eating at a steady rate with pauses,
+	sensor noise and a slow drift (g/h) such as wet food drying out."""
+	start = int(time.time()) - 86400
+	truth = []
+	for meal in (8 * 3600, 18 * 3600):
+		at = meal + random.randint(60, 900)
+		for _ in range(random.randint(1, 2)):
+			length = random.randint(60, 300)
+			truth.append(Bout(start + at, start + at + length, random.uniform(5, 20), 0))
+			at += length + random.randint(600, 3600)
+	times = []
+	values = []
+	bowl = 5.0
+	for i in range(86400 // period):
+		t = i * period
+		if(t in (8 * 3600, 18 * 3600)):
+			bowl += 40
+		bowl += drift * period / 3600
+		for b in truth:
+			if(b.start <= start + t < b.end and random.random() < 0.7):
+				bowl -= b.grams / ((b.end - b.start) / period * 0.7)
+		times.append(start + t)
+		values.append(bowl + random.gauss(0, noise))
+	return (times, values, truth)
+
+
+def score(found, truth):
+	matched = 0
+	start_err = []
+	gram_err = []
+	for b in truth:
+		hits = [f for f in found if f.start < b.end and b.start < f.end]
+		if(hits):
+			matched += 1
+			start_err.append(abs(hits[0].start - b.start))
+			gram_err.append(abs(sum(f.grams for f in hits) - b.grams))
+	return (matched, start_err, gram_err)
+
+
+def bench(days):
+	matched = 0
+	total = 0
+	found = 0
+	start_err = []
+	gram_err = []
+	samples = 0
+	for _ in range(days):
+		(times, values, truth) = synthetic_day()
+		bouts = segment(times, values)
+		(m, s, g) = score(bouts, truth)
+		matched += m
+		total += len(truth)
+		found += len(bouts)
+		start_err += s
+		gram_err += g
+		samples += len(times)
+	start_err.sort()
+	gram_err.sort()
+	print("{} days: {}/{} bouts found, {} reported".format(days, matched, total, found))
+	if(start_err):
+		print("start error p50 {} s, grams error p50 {:.1f} g  p90 {:.1f} g".format(
+			start_err[len(start_err) // 2], gram_err[len(gram_err) // 2], gram_err[int(len(gram_err) * 0.9)]))
+	print("{} samples reduced to {} summaries".format(samples, found))
+
+
+if(__name__ == "__main__"):
+	import argparse
+	parser = argparse.ArgumentParser(description="Segment weight traces into eating bouts")
+	parser.add_argument('store', nargs='?', help="telemetry store directory with recorded weight")
+	parser.add_argument('-n', '--days', type=int, default=30, help="synthetic days")
+	parser.add_argument('-x', '--export', help="directory to write traces and the bouts found in them to")
+	parser.add_argument('--seed', type=int, default=1, help="random seed of the exported synthetic days")
+	args = parser.parse_args()
+
+	if(args.export):
+		if(args.store):
+			store = TimeSeriesStore(args.store)
+			for device in store.devices():
+				export(args.export, device, *store.scan(device, 'weight'))
+		else:
+			random.seed(args.seed)
+			for day in range(args.days):
+				(times, values, _) = synthetic_day(period=10)
+				export(args.export, 'synthetic-{}'.format(day + 1), *meal_windows(times, values))
+	elif(args.store):
+		store = TimeSeriesStore(args.store)
+		for device in store.devices():
+			for b in segment(*store.scan(device, 'weight')):
+				print("{}: {} for {} s, {:.1f} g, peak {:.1f} g/min".format(
+					device, time.strftime('%Y-%m-%d %H:%M', time.localtime(b.start)), b.end - b.start, b.grams, b.peak_rate))
+	else:
+		bench(args.days)
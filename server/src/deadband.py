@@ -0,0 +1,75 @@
+#!/usr/bin/env python3
+
+"""
+Message count of polled versus report-by-exception weight telemetry.
+
+Replays day-long weight series recorded in the telemetry store through the
+firmware's reporting rule: a weight goes out when it is at least
+`deadband` grams from the last one sent, or `interval` seconds after it.
+Polling costs a request and a reply per sample. Without a store a
+synthetic day is used: two meals, eating bouts and sensor noise.
+	./deadband.py ../telemetry -d 2.5 -i 3600
+"""
+
+import random
+import time
+
+from tsdb import TimeSeriesStore
+
+
+def exception_reports(times, values, deadband, interval):
+	reported = None
+	at = None
+	count = 0
+	for (t, w) in zip(times, values):
+		if(reported is None or abs(w - reported) >= deadband or t - at >= interval):
+			reported = w
+			at = t
+			count += 1
+	return count
+
+
+def synthetic_day(period=60, noise=0.5):
+	times = []
+	values = []
+	bowl = 5.0
+	start = time.time() - 86400
+	for i in range(86400 // period):
+		t = i * period
+		hour = t / 3600
+		if(t % 86400 in (8 * 3600, 18 * 3600)):
+			bowl += 40
+		# a few minutes of eating after each meal and a late snack
+		if(8.1 <= hour < 8.2 or 18.1 <= hour < 18.25 or 22 <= hour < 22.05):
+			bowl = max(0.0, bowl - random.uniform(1, 4))
+		times.append(start + t)
+		values.append(bowl + random.gauss(0, noise))
+	return (times, values)
+
+
+def replay(traces, deadband, interval):
+	polled = 0
+	reports = 0
+	for (name, (times, values)) in traces:
+		n = exception_reports(times, values, deadband, interval)
+		print("{}: {} samples, {} polled messages, {} reports".format(name, len(times), 2 * len(times), n))
+		polled += 2 * len(times)
+		reports += n
+	if(reports):
+		print("total: {} polled messages, {} reports, {:.1f}x fewer".format(polled, reports, polled / reports))
+
+
+if(__name__ == "__main__"):
+	import argparse
+	parser = argparse.ArgumentParser(description="Compare polled and report-by-exception weight message counts")
+	parser.add_argument('store', nargs='?', help="telemetry store directory with recorded weight")
+	parser.add_argument('-d', '--deadband', type=float, default=2.5, help="grams")
+	parser.add_argument('-i', '--interval', type=float, default=3600, help="seconds")
+	args = parser.parse_args()
+
+	if(args.store):
+		store = TimeSeriesStore(args.store)
+		traces = [(device, store.scan(device, 'weight')) for device in store.devices()]
+	else:
+		traces = [('synthetic', synthetic_day())]
+	replay(traces, args.deadband, args.interval)
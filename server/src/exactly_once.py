@@ -0,0 +1,226 @@
+#!/usr/bin/env python3
+
+"""
+Fault injection test: every meal is dispensed exactly once.
+
+A DeviceRegistry shard and a set of simulated feeders talk through a local
+broker, and every publish in either direction is dropped with probability
+`loss` or sent twice with probability `dup`, on top of the broker's own
+QoS1 redeliveries. The simulated feeders handle command ids like the
+firmware: the last DEDUPE_WINDOW ids are kept with their result, and a
+repeated id is acked again without being executed. That window lives in
+RTC memory on the feeder, so it is kept when the server is restarted half
+way through the meals.
+
+Early on, the feeders also go offline for `outage` seconds, long enough for
+the server to give up on the meals sent meanwhile. Like the broker's
+persistent session, the feeders keep what was sent to them while offline
+and run it when they come back. The test fails if a feeder dispensed a
+meal twice, if the server recorded a meal that was not dispensed, or if a
+meal went unrecorded without the server having given up on it.
+	mosquitto -p 1883 &
+	./exactly_once.py -b localhost:1883
+"""
+
+import asyncio
+import json
+import random
+import sys
+import threading
+import time
+from collections import OrderedDict
+from datetime import datetime, timedelta
+
+import petfeeder
+from localmqtt import LocalMQTTClient
+from registry import DeviceRegistry, device_topic
+from scheduler import Scheduler
+
+DEDUPE_WINDOW = 8
+
+
+class LossyClient:
+	# Drops or duplicates publishes and, once closed, cuts the client off
+	# both ways like a stopped server
+
+	def __init__(self, client, loss, dup):
+		self.client = client
+		self.loss = loss
+		self.dup = dup
+		self.open = True
+		self.dropped = 0
+		self.duplicated = 0
+
+	def __getattr__(self, name):
+		return getattr(self.client, name)
+
+	def subscribe(self, topic, qos, callback):
+		return self.client.subscribe(topic, qos, lambda client, userdata, message: self.open and callback(self, userdata, message))
+
+	def publish(self, topic, payload, qos):
+		if(not self.open):
+			return False
+		if(random.random() < self.loss):
+			self.dropped += 1
+			return True
+		if(random.random() < self.dup):
+			self.duplicated += 1
+			self.client.publish(topic, payload, qos)
+		return self.client.publish(topic, payload, qos)
+
+
+class FeederSim:
+	# Executes and acks commands for any number of serial numbers, deduping
+	# ids like the firmware; runs on the MQTT client thread
+
+	def __init__(self, client):
+		self.client = client
+		# serial -> OrderedDict of id -> result
+		self.seen = {}
+		self.dispensed = {}
+		self.lock = threading.Lock()
+		# commands that arrived while offline, run on reconnect
+		self.offline = False
+		self.backlog = []
+		client.subscribe(device_topic('+', 'from_aws'), 1, self.on_command)
+
+	def outage(self, start, length):
+		def down():
+			with self.lock:
+				self.offline = True
+		def up():
+			with self.lock:
+				self.offline = False
+				(backlog, self.backlog) = (self.backlog, [])
+			print("feeders back after {} s with {} commands queued".format(length, len(backlog)))
+			for (client, message) in backlog:
+				self.on_command(client, None, message)
+		threading.Timer(start, down).start()
+		threading.Timer(start + length, up).start()
+
+	def on_command(self, client, userdata, message):
+		with self.lock:
+			if(self.offline):
+				self.backlog.append((client, message))
+				return
+		serial_num = message.topic.split('/')[1]
+		msg_json = json.loads(message.payload)
+		cmd_id = msg_json['id']
+		with self.lock:
+			seen = self.seen.setdefault(serial_num, OrderedDict())
+			result = seen.get(cmd_id)
+			if(result is None):
+				if('dispense' in msg_json.get('request', ())):
+					self.dispensed[serial_num] = self.dispensed.get(serial_num, 0) + 1
+				result = 'done'
+				seen[cmd_id] = result
+				if(len(seen) > DEDUPE_WINDOW):
+					seen.popitem(last=False)
+		client.publish(device_topic(serial_num, 'to_aws'), json.dumps({'ack': [{'id': cmd_id, 'result': result}]}), 1)
+
+
+class Tally:
+	# Telemetry store that only counts the dispenses the server recorded
+
+	def __init__(self):
+		self.dispensed = {}
+
+	def append(self, serial_num, metric, t, value):
+		if(metric == 'dispense'):
+			self.dispensed[serial_num] = self.dispensed.get(serial_num, 0) + 1
+
+
+def open_local(client_id, broker):
+	client = LocalMQTTClient(client_id)
+	(host, port) = broker.split(':')
+	client.configureEndpoint(host, int(port))
+	client.connect()
+	return client
+
+
+def run_server(loop, broker, serials, num_meals, spacing, tally, loss, dup, settle):
+	"""Runs one server lifetime until settle seconds after its last meal."""
+	start = datetime.now().astimezone()
+	meals = [start + timedelta(seconds=2 + spacing * n) for n in range(num_meals)]
+	client = LossyClient(open_local('exactly-once-server-{}'.format(time.time()), broker), loss, dup)
+	reg = DeviceRegistry(client, tally)
+	sched = Scheduler(loop, fleet=reg)
+	for serial_num in serials:
+		sched.add_device(reg.add(serial_num, meals))
+	reg.subscribe()
+	duration = 2 + spacing * num_meals + settle
+	try:
+		loop.run_until_complete(asyncio.wait_for(sched.run(), duration))
+	except asyncio.TimeoutError:
+		pass
+	client.open = False
+	return (reg, client)
+
+
+def run(broker, num_feeders, num_meals, spacing, loss, dup, settle, outage):
+	# Commands are retried quickly, so the server gives up on a meal after
+	# ack_timeout * (max_retries + 1) seconds without an answer
+	petfeeder.ack_timeout = 1.0
+	loop = asyncio.new_event_loop()
+	asyncio.set_event_loop(loop)
+	feeders = LossyClient(open_local('exactly-once-feeders', broker), loss, dup)
+	sim = FeederSim(feeders)
+	time.sleep(0.5)
+	if(outage):
+		sim.outage(2.5, outage)
+
+	serials = ['fault-{}'.format(n) for n in range(num_feeders)]
+	tally = Tally()
+	half = num_meals // 2
+	retransmits = 0
+	redundant = 0
+	abandoned = 0
+	late = 0
+	dropped = 0
+	duplicated = 0
+	for lifetime in (half, num_meals - half):
+		(reg, client) = run_server(loop, broker, serials, lifetime, spacing, tally, loss, dup, settle)
+		retransmits += reg.retransmits
+		redundant += reg.redundant
+		abandoned += reg.abandoned
+		late += reg.late
+		dropped += client.dropped
+		duplicated += client.duplicated
+		print("server stopped with {} commands in flight".format(sum(len(pending) for pending in reg.in_flight.values())))
+	dropped += feeders.dropped
+	duplicated += feeders.duplicated
+	print("{} feeders x {} meals over a restart: {} publishes dropped, {} duplicated, {} retransmits, {} redundant acks".format(
+		num_feeders, num_meals, dropped, duplicated, retransmits, redundant))
+	print("{} meals given up on, {} of them acked done late".format(abandoned, late))
+
+	failed = 0
+	unrecorded = 0
+	for serial_num in serials:
+		(done, recorded) = (sim.dispensed.get(serial_num, 0), tally.dispensed.get(serial_num, 0))
+		unrecorded += num_meals - recorded
+		if(done > num_meals or recorded > done):
+			failed += 1
+			print("{}: dispensed {}, recorded {}, {} meals".format(serial_num, done, recorded, num_meals))
+	# a meal the server gave up on may have been dispensed with its late ack lost
+	if(unrecorded > abandoned - late):
+		failed += 1
+		print("{} meals unrecorded but only {} given up on without an ack".format(unrecorded, abandoned - late))
+	print("FAIL" if failed else "PASS: no meal dispensed twice, every meal recorded once unless given up on")
+	return failed == 0
+
+
+if(__name__ == "__main__"):
+	import argparse
+	parser = argparse.ArgumentParser(description="Check exactly-once dispensing with publishes dropped and duplicated")
+	parser.add_argument('-b', '--broker', default='localhost:1883')
+	parser.add_argument('-n', '--feeders', type=int, default=20)
+	parser.add_argument('-m', '--meals', type=int, default=6)
+	parser.add_argument('-i', '--interval', type=float, default=2, help="seconds between meals")
+	parser.add_argument('-l', '--loss', type=float, default=0.2)
+	parser.add_argument('-d', '--dup', type=float, default=0.2)
+	parser.add_argument('-s', '--settle', type=float, default=10, help="seconds to wait after the last meal")
+	parser.add_argument('-o', '--outage', type=float, default=8, help="seconds the feeders are offline, 0 for none")
+	parser.add_argument('--seed', type=int)
+	args = parser.parse_args()
+	random.seed(args.seed)
+	sys.exit(0 if run(args.broker, args.feeders, args.meals, args.interval, args.loss, args.dup, args.settle, args.outage) else 1)
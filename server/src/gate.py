@@ -0,0 +1,183 @@
+#!/usr/bin/env python3
+
+"""
+Identity gating of dispenses.
+
+A feeder configured with per-pet portions does not dispense when its
+schedule comes due. Instead the meal is armed for `window` seconds. The
+camera daemon (automated_functions/camera.py) answers every motion event
+with the pets it recognized on pet-feeder/<serial>/identity; each armed
+pet recognized with at least `min_conf` gets its own portion, once per
+meal. The confidence is the recognizer's calibrated probability for the
+pet, so the same threshold holds for two pets or five; a face it is unsure
+of waits for the next motion event rather than feeding the wrong pet. The
+meal closes when every pet has eaten or the window runs out, and the
+schedule moves on to the next slot.
+
+Every decision is timed from the motion event as the feeder stamped it:
+the camera reports the uplink from the feeder plus its queue, capture and
+recognition times, transit covers the hops from the camera to here and the
+rest is the decision. The clocks of the feeder, the camera and this server
+are all NTP synced; a feeder without a synced clock is timed from when the
+camera got its report. Decisions slower than `budget` are counted.
+
+The whole flow runs on one Linux box against a local broker, with
+recorded pictures standing in for the camera. List the simulated feeder in
+devices.json with its pets and dispense times a minute apart, so a meal
+opens for every simulated motion event:
+	mosquitto -p 1883 &
+	./registry.py devices.json -s 1 -b localhost:1883
+	(cd ../../automated_functions && python camera.py -b localhost:1883 -r data)
+	./gate.py -b localhost:1883 -f <serial>
+"""
+
+import time
+
+STAGES = ('uplink', 'queue', 'capture', 'recognize', 'transit', 'decide', 'total')
+
+
+class PetPortion:
+
+	def __init__(self, channel, grams):
+		self.channel = channel
+		self.grams = grams
+
+
+class Meal:
+
+	def __init__(self, pets, closes):
+		self.hungry = set(pets)
+		self.closes = closes
+
+
+class IdentityGate:
+
+	def __init__(self, min_conf=0.65, window=7200, budget=1.5, stale=10):
+		self.min_conf = min_conf
+		self.window = window
+		self.budget = budget
+		self.stale = stale
+		# device -> {pet name: PetPortion}
+		self.pets = {}
+		# device -> Meal, only while a meal is open
+		self.meals = {}
+		self.timings = {stage: [] for stage in STAGES}
+		self.decisions = 0
+		self.over_budget = 0
+
+	def set_pets(self, device, pets):
+		self.pets[device] = pets
+
+	def is_gated(self, device):
+		return device in self.pets
+
+	def arm(self, device):
+		self.meals[device] = Meal(self.pets[device], time.time() + self.window)
+
+	def closes(self, device):
+		meal = self.meals.get(device)
+		return meal.closes if meal is not None else None
+
+	def expired(self, device):
+		meal = self.meals.get(device)
+		if(meal is not None and time.time() >= meal.closes):
+			print("Meal window closed for {}, not fed: {}".format(device, ', '.join(sorted(meal.hungry))))
+			del self.meals[device]
+			return True
+		return False
+
+	def on_identity(self, device, msg_json):
+		"""Returns (closed, [(pet, PetPortion)]) for an identity report.
+
+		closed is True when the meal ended because every pet was fed.
+		"""
+		received = time.time()
+		meal = self.meals.get(device)
+		if(meal is None or received - msg_json.get('motion', received) > self.stale):
+			return (False, [])
+		fed = []
+		for pet in msg_json.get('pets', ()):
+			if(pet['name'] in meal.hungry and pet['conf'] >= self.min_conf):
+				meal.hungry.discard(pet['name'])
+				fed.append((pet['name'], self.pets[device][pet['name']]))
+		if(fed):
+			self.time_decision(device, msg_json, received, fed)
+		if(not meal.hungry):
+			del self.meals[device]
+			return (True, fed)
+		return (False, fed)
+
+	def time_decision(self, device, msg_json, received, fed):
+		now = time.time()
+		ms = dict(msg_json.get('ms', {}))
+		total = (now - msg_json.get('motion', received)) * 1e3
+		ms['decide'] = (now - received) * 1e3
+		ms['transit'] = total - ms['decide'] - sum(ms.get(stage, 0) for stage in STAGES[:4])
+		ms['total'] = total
+		for stage in STAGES:
+			self.timings[stage].append(ms.get(stage, 0))
+		self.decisions += 1
+		if(total > self.budget * 1e3):
+			self.over_budget += 1
+		print("Gate open for {} on {} after {:.0f} ms ({})".format(
+			', '.join(pet for (pet, _) in fed), device, total,
+			', '.join("{} {:.0f}".format(stage, ms.get(stage, 0)) for stage in STAGES[:-1])))
+
+	def report(self):
+		lines = ["{} decisions, {} over the {:.1f} s budget".format(self.decisions, self.over_budget, self.budget)]
+		for stage in STAGES:
+			values = sorted(self.timings[stage])
+			if(values):
+				lines.append("{:>9}: p50 {:6.0f} ms  p99 {:6.0f} ms".format(stage, values[len(values) // 2], values[int(len(values) * 0.99)]))
+		return '\n'.join(lines)
+
+
+def simulate(client, serial_num, interval, count):
+	# Stands in for the feeder: reports motion and times how long it takes
+	# until a portion command comes back
+	import json
+	import threading
+	import registry
+
+	opened = threading.Event()
+
+	def from_aws(client, userdata, message):
+		msg_json = json.loads(message.payload)
+		if('portions' in msg_json):
+			opened.set()
+		if('id' in msg_json):
+			ack = {'ack': [{'id': msg_json['id'], 'result': 'done'}]}
+			client.publish(registry.device_topic(serial_num, 'to_aws'), json.dumps(ack), 1)
+
+	client.subscribe(registry.device_topic(serial_num, 'from_aws'), 1, from_aws)
+	latency = []
+	for _ in range(count):
+		opened.clear()
+		start = time.time()
+		client.publish(registry.device_topic(serial_num, 'motion'), json.dumps({'motion': 1, 't': start}), 1)
+		if(opened.wait(interval)):
+			latency.append(time.time() - start)
+			print("motion to portion: {:.0f} ms".format(latency[-1] * 1e3))
+		else:
+			print("no portion within {} s".format(interval))
+		time.sleep(max(0, interval - (time.time() - start)))
+	latency.sort()
+	if(latency):
+		print("{}/{} gated, p50 {:.0f} ms  p99 {:.0f} ms".format(len(latency), count, latency[len(latency) // 2] * 1e3, latency[int(len(latency) * 0.99)] * 1e3))
+
+
+if(__name__ == "__main__"):
+	import argparse
+	from localmqtt import LocalMQTTClient
+	parser = argparse.ArgumentParser(description="Simulate a gated feeder against a local broker")
+	parser.add_argument('-b', '--broker', default='localhost:1883')
+	parser.add_argument('-f', '--feeder', required=True, help="serial number of a gated feeder in devices.json")
+	parser.add_argument('-i', '--interval', type=float, default=60)
+	parser.add_argument('-n', '--count', type=int, default=20)
+	args = parser.parse_args()
+
+	client = LocalMQTTClient('feeder-sim')
+	(host, port) = args.broker.split(':')
+	client.configureEndpoint(host, int(port))
+	client.connect()
+	simulate(client, args.feeder, args.interval, args.count)
@@ -0,0 +1,227 @@
+#!/usr/bin/env python3
+
+"""
+Edge gateway for sites with many feeders, such as shelters and catteries.
+
+The feeders of the site connect to a broker on the LAN instead of AWS IoT
+(the firmware endpoint points at it). The gateway runs the dispense
+schedule for them from its own copy of their devices.json entries, so
+commands, acks and polls never leave the site and meals keep coming while
+the uplink is down. Telemetry goes upstream over a single connection:
+exact repeats from a device within `dedupe_window` (QoS1 redeliveries)
+are dropped, and the rest, acks included, leaves as one message per
+`interval` on pet-feeder/<site>/batch:
+	{"site": "shelter-1", "msgs": [[serial, leaf, message], ...]}
+What only the gateway can tell, because it runs the schedule, rides along
+with leaf "record":
+	[serial, "record", {"metric": "dispense", "value": 40, "t": <epoch s>}]
+for the grams dispensed and the grams eaten at each meal. The cloud
+registry unpacks the batches into its telemetry store and feeds the eaten
+records to its diet detector, so alerts for the site come from the cloud.
+Devices listed there with "gateway": "<site>" are not scheduled in the
+cloud.
+
+	./gateway.py shelter-1.json -s shelter-1 -l localhost:1883
+
+Load test with simulated feeders, counting what reaches the upstream
+broker:
+	mosquitto -p 1883 &
+	./gateway.py -n 500 -l localhost:1883 -u localhost:1883
+"""
+
+import asyncio
+import json
+import random
+import time
+
+import registry
+from gate import IdentityGate
+from portion import PortionController
+from registry import DeviceRegistry, device_topic
+from scheduler import Scheduler
+
+
+class Batcher:
+
+	def __init__(self, loop, client, site, interval=5.0, max_bytes=64 * 1024, dedupe_window=5.0):
+		self.loop = loop
+		self.client = client
+		self.topic = device_topic(site, 'batch')
+		self.site = site
+		self.interval = interval
+		# AWS IoT takes messages up to 128 KB
+		self.max_bytes = max_bytes
+		self.dedupe_window = dedupe_window
+		self.msgs = []
+		self.size = 0
+		self.timer = None
+		# serial -> (last payload, when)
+		self.recent = {}
+		self.received = 0
+		self.dropped = 0
+		self.forwarded = 0
+		self.batches = 0
+
+	def add(self, serial_num, leaf, payload):
+		self.received += 1
+		now = time.time()
+		if(leaf == 'to_aws'):
+			last = self.recent.get(serial_num)
+			self.recent[serial_num] = (payload, now)
+			if(last is not None and last[0] == payload and now - last[1] < self.dedupe_window):
+				self.dropped += 1
+				return
+		self.append([serial_num, leaf, json.loads(payload)], len(payload))
+
+	def add_record(self, serial_num, metric, value, t):
+		self.append([serial_num, 'record', {'metric': metric, 'value': value, 't': t}], 64)
+
+	def append(self, msg, size):
+		self.msgs.append(msg)
+		self.size += size + len(msg[0]) + 16
+		if(self.size >= self.max_bytes):
+			self.flush()
+		elif(self.timer is None):
+			self.timer = self.loop.call_later(self.interval, self.flush)
+
+	def flush(self):
+		if(self.timer is not None):
+			self.timer.cancel()
+			self.timer = None
+		if(not self.msgs):
+			return
+		self.client.publish(self.topic, json.dumps({'site': self.site, 'msgs': self.msgs}), 1)
+		self.batches += 1
+		self.forwarded += len(self.msgs)
+		self.msgs = []
+		self.size = 0
+
+	def report(self):
+		return "{} feeder messages, {} dropped, {} forwarded in {} upstream messages".format(
+			self.received, self.dropped, self.forwarded, self.batches)
+
+
+class EdgeRegistry(DeviceRegistry):
+	# Schedules the site's feeders and hands their telemetry to the batcher,
+	# along with the dispense and eaten records the schedule produces
+
+	def __init__(self, client, batcher, controller=None, gate=None):
+		DeviceRegistry.__init__(self, client, None, controller, gate)
+		self.batcher = batcher
+
+	def subscribe(self):
+		# batches are the gateway's own output, never input
+		for leaf in self.handlers:
+			self.client.subscribe(device_topic('+', leaf), 1, self.on_message)
+
+	def route(self, topic, payload):
+		DeviceRegistry.route(self, topic, payload)
+		(_, serial_num, leaf) = topic.split('/', 2)
+		# identities come from the site's own camera and stay here
+		if(serial_num in self.rows and leaf != 'identity'):
+			self.batcher.add(serial_num, leaf, payload)
+
+	def record(self, row, metric, value, t=None):
+		# Everything else is in the feeder's own messages
+		if(metric in ('dispense', 'eaten')):
+			self.batcher.add_record(self.serial_num[row], metric, value, t if t is not None else time.time())
+
+
+def start_gateway(loop, site, devices, local, upstream):
+	"""Returns the registry; its scheduler runs as a task on loop."""
+	batcher = Batcher(loop, upstream, site)
+	reg = EdgeRegistry(local, batcher, PortionController(), IdentityGate())
+	sched = Scheduler(loop, fleet=reg)
+	lan_keys = {}
+	for device in devices:
+		registry.add_device(reg, sched, device, lan_keys)
+	registry.open_lan(loop, reg, lan_keys)
+	print("Gateway {}: {} devices, {} on the LAN".format(site, len(reg), len(lan_keys)))
+	local.connect()
+	upstream.connect()
+	reg.subscribe()
+	loop.create_task(sched.run())
+	return reg
+
+
+def simulate(loop, num_feeders, local_broker, upstream_broker, duration, period=10.0, duplicates=0.05):
+	# Feeders report weight every `period` seconds and ack every command; a
+	# fraction of reports is sent twice like a QoS1 redelivery
+	from localmqtt import LocalMQTTClient
+	devices = [{'serial_num': 'sim-{}'.format(n), 'times': ['08:00', '18:00'], 'dispense_amount': 40} for n in range(num_feeders)]
+	reg = start_gateway(loop, 'sim-site', devices,
+	                    registry.open_client('gateway-local', None, None, local_broker),
+	                    registry.open_client('gateway-upstream', None, None, upstream_broker))
+
+	feeders = LocalMQTTClient('feeder-sim')
+	(host, port) = local_broker.split(':')
+	feeders.configureEndpoint(host, int(port))
+	feeders.connect()
+	sent = [0]
+
+	def from_aws(client, userdata, message):
+		serial_num = message.topic.split('/')[1]
+		msg_json = json.loads(message.payload)
+		client.publish(device_topic(serial_num, 'to_aws'), json.dumps({'ack': [{'id': msg_json['id'], 'result': 'done'}]}), 1)
+		sent[0] += 1
+
+	feeders.subscribe(device_topic('+', 'from_aws'), 1, from_aws)
+
+	upstream = LocalMQTTClient('cloud-sim')
+	(host, port) = upstream_broker.split(':')
+	upstream.configureEndpoint(host, int(port))
+	upstream.connect()
+	received = [0, 0]
+
+	def on_batch(client, userdata, message):
+		received[0] += 1
+		received[1] += len(json.loads(message.payload)['msgs'])
+
+	upstream.subscribe(device_topic('+', 'batch'), 1, on_batch)
+
+	async def report_weights():
+		start = time.time()
+		n = 0
+		while(time.time() - start < duration):
+			serial_num = devices[n % num_feeders]['serial_num']
+			payload = json.dumps({'weight': round(random.uniform(0, 50), 1)})
+			for _ in range(2 if random.random() < duplicates else 1):
+				feeders.publish(device_topic(serial_num, 'to_aws'), payload, 1)
+				sent[0] += 1
+			n += 1
+			await asyncio.sleep(period / num_feeders)
+		reg.batcher.flush()
+		await asyncio.sleep(1)
+
+	loop.run_until_complete(report_weights())
+	print(reg.batcher.report())
+	print("{} feeders sent {} messages over {} connections; upstream got {} messages ({} records) over 1 connection, {:.0f}x fewer".format(
+		num_feeders, sent[0], num_feeders, received[0], received[1], sent[0] / max(received[0], 1)))
+
+
+if(__name__ == "__main__"):
+	import argparse
+	parser = argparse.ArgumentParser(description="Run the schedule of a site's feeders and batch their telemetry upstream")
+	parser.add_argument('devices', nargs='?', help="JSON file listing the site's feeders")
+	parser.add_argument('-s', '--site', default='site')
+	parser.add_argument('-l', '--local', default='localhost:1883', help="host:port of the site broker")
+	parser.add_argument('-u', '--upstream', help="host:port of a broker to use instead of AWS IoT")
+	parser.add_argument('-e', '--endpoint', default='a2ot5vs3yt7xtc-ats.iot.us-west-2.amazonaws.com')
+	parser.add_argument('-p', '--port', type=int, default=8883)
+	parser.add_argument('-n', '--simulate', type=int, help="load test with this many simulated feeders")
+	parser.add_argument('-t', '--duration', type=float, default=60)
+	args = parser.parse_args()
+
+	loop = asyncio.new_event_loop()
+	asyncio.set_event_loop(loop)
+	if(args.simulate):
+		simulate(loop, args.simulate, args.local, args.upstream or args.local, args.duration)
+	else:
+		reg = start_gateway(loop, args.site, registry.load_devices(args.devices),
+		                    registry.open_client('gateway-local', None, None, args.local),
+		                    registry.open_client('gateway-' + args.site, args.endpoint, args.port, args.upstream))
+		try:
+			loop.run_forever()
+		finally:
+			reg.batcher.flush()
+			print(reg.batcher.report())
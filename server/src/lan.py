@@ -0,0 +1,202 @@
+#!/usr/bin/env python3
+
+"""
+LAN control channel between the scheduler and feeders on the same network.
+
+Commands normally go device -> AWS IoT -> device, which costs two trips to
+the cloud. When a feeder has a LAN key provisioned (NVS blob "lan_key" in
+the "pet-feeder" namespace, "lan_key" as hex in devices.json) the
+scheduler also talks to it over UDP:
+
+	"PF" | version | type | seq (u32, big endian) | id length | id | JSON | mac
+
+mac is the first 16 bytes of HMAC-SHA256 over the rest of the packet with
+the device's key, and every side drops sequence numbers it has already
+seen. Types are 'D' discover, 'A' announce, 'C' command and 'T' telemetry.
+Neither side's sequence numbers go back: the hub's have the wall clock as
+their floor and the feeder keeps its own in NVS across power cycles. An
+announce carries {"d": <seq>} of the discover it answers, and the hub
+takes nothing from a device before an announce for its latest discover,
+so a captured packet can neither be replayed after a restart nor move the
+device to another address.
+
+Feeders sleep most of the time, so discovery happens per wake: when the
+registry sees a device wake up it broadcasts a discover, and the device
+answers from its address. While the device was heard from within `fresh`
+seconds commands go over the LAN; otherwise, and for every retransmission,
+they go through the broker as before.
+
+Round-trip times of both paths, with a simulated feeder on this machine:
+	./lan.py
+	mosquitto -p 1883 & ./lan.py -b localhost:1883
+"""
+
+import asyncio
+import hashlib
+import hmac
+import json
+import socket
+import struct
+import time
+
+LAN_PORT = 4210
+VERSION = 2
+MAC_LEN = 16
+HEADER = struct.Struct('>2sBcIB')
+
+
+def encode(key, kind, seq, serial_num, payload):
+	ident = serial_num.encode()
+	body = HEADER.pack(b'PF', VERSION, kind, seq, len(ident)) + ident + payload
+	return body + hmac.new(key, body, hashlib.sha256).digest()[:MAC_LEN]
+
+
+def decode(keys, packet):
+	"""Returns (kind, seq, serial_num, payload), or None for a packet that is
+	malformed, for an unknown device or fails authentication."""
+	if(len(packet) < HEADER.size + MAC_LEN):
+		return None
+	(magic, version, kind, seq, id_len) = HEADER.unpack_from(packet)
+	if(magic != b'PF' or version != VERSION or len(packet) < HEADER.size + id_len + MAC_LEN):
+		return None
+	serial_num = packet[HEADER.size:HEADER.size + id_len].decode(errors='replace')
+	key = keys.get(serial_num)
+	body = packet[:-MAC_LEN]
+	if(key is None or not hmac.compare_digest(hmac.new(key, body, hashlib.sha256).digest()[:MAC_LEN], packet[-MAC_LEN:])):
+		return None
+	return (kind, seq, serial_num, body[HEADER.size + id_len:])
+
+
+class LanChannel(asyncio.DatagramProtocol):
+
+	def __init__(self, keys, handler, device_port=LAN_PORT, fresh=2.5):
+		# keys: serial -> key bytes; handler(serial, payload) gets telemetry
+		self.keys = keys
+		self.handler = handler
+		self.device_port = device_port
+		self.fresh = fresh
+		self.transport = None
+		self.seq = 0
+		# serial -> [address, last heard, last seq]
+		self.peers = {}
+		# serial -> seq of the latest discover, which the announce must echo
+		self.challenges = {}
+		self.sent = 0
+		self.dropped = 0
+
+	def connection_made(self, transport):
+		self.transport = transport
+		transport.get_extra_info('socket').setsockopt(socket.SOL_SOCKET, socket.SO_BROADCAST, 1)
+
+	def next_seq(self):
+		# Wall clock seconds as the floor, so a restarted hub starts above
+		# whatever the devices accepted before
+		self.seq = max(self.seq + 1, int(time.time()))
+		return self.seq
+
+	def discover(self, serial_num, address='<broadcast>'):
+		if(self.transport is not None and serial_num in self.keys):
+			self.challenges[serial_num] = self.next_seq()
+			packet = encode(self.keys[serial_num], b'D', self.challenges[serial_num], serial_num, b'{}')
+			self.transport.sendto(packet, (address, self.device_port))
+
+	def send(self, serial_num, msg_json):
+		"""Sends a command if the device is reachable on the LAN right now."""
+		peer = self.peers.get(serial_num)
+		if(self.transport is None or peer is None or time.time() - peer[1] > self.fresh):
+			return False
+		packet = encode(self.keys[serial_num], b'C', self.next_seq(), serial_num, json.dumps(msg_json).encode())
+		self.transport.sendto(packet, peer[0])
+		self.sent += 1
+		return True
+
+	def datagram_received(self, packet, address):
+		decoded = decode(self.keys, packet)
+		if(decoded is None):
+			self.dropped += 1
+			return
+		(kind, seq, serial_num, payload) = decoded
+		peer = self.peers.get(serial_num)
+		if(kind == b'A'):
+			fresh = json.loads(payload).get('d') == self.challenges.get(serial_num)
+		else:
+			fresh = peer is not None
+		if(not fresh or (peer is not None and seq <= peer[2])):
+			self.dropped += 1
+			return
+		self.peers[serial_num] = [address, time.time(), seq]
+		if(kind == b'T'):
+			self.handler(serial_num, payload)
+
+
+async def bench(count, broker=None):
+	import os
+	key = os.urandom(32)
+	serial_num = 'lan-bench'
+	loop = asyncio.get_running_loop()
+	replies = asyncio.Queue()
+
+	class Device(asyncio.DatagramProtocol):
+		# Acks every command over the LAN, like the firmware with a hub known
+		def connection_made(self, transport):
+			self.transport = transport
+			self.seq = 0
+
+		def datagram_received(self, packet, address):
+			(kind, seq, _, payload) = decode({serial_num: key}, packet)
+			self.seq += 1
+			if(kind == b'D'):
+				self.transport.sendto(encode(key, b'A', self.seq, serial_num, json.dumps({'d': seq}).encode()), address)
+			elif(kind == b'C'):
+				ack = {'ack': [{'id': json.loads(payload)['id'], 'result': 'done'}]}
+				self.transport.sendto(encode(key, b'T', self.seq, serial_num, json.dumps(ack).encode()), address)
+
+	(device, _) = await loop.create_datagram_endpoint(Device, local_addr=('127.0.0.1', 0))
+	(_, hub) = await loop.create_datagram_endpoint(
+		lambda: LanChannel({serial_num: key}, lambda serial_num, payload: replies.put_nowait(time.perf_counter()),
+		                   device.get_extra_info('sockname')[1], fresh=60),
+		local_addr=('127.0.0.1', 0))
+	hub.discover(serial_num, '127.0.0.1')
+	await asyncio.sleep(0.1)
+
+	def report(name, rtt):
+		rtt.sort()
+		print("{}: {} round trips, p50 {:.2f} ms  p99 {:.2f} ms".format(name, len(rtt), rtt[len(rtt) // 2] * 1e3, rtt[int(len(rtt) * 0.99)] * 1e3))
+
+	rtt = []
+	for cmd_id in range(count):
+		start = time.perf_counter()
+		hub.send(serial_num, {'request': ['weight'], 'id': cmd_id})
+		rtt.append(await replies.get() - start)
+	report("LAN", rtt)
+
+	if(broker):
+		import registry
+		from localmqtt import LocalMQTTClient
+		(host, port) = broker.split(':')
+		server = LocalMQTTClient('lan-bench-server')
+		feeder = LocalMQTTClient('lan-bench-feeder')
+		for client in (server, feeder):
+			client.configureEndpoint(host, int(port))
+			client.connect()
+		feeder.subscribe(registry.device_topic(serial_num, 'from_aws'), 1,
+		                 lambda client, userdata, message: client.publish(registry.device_topic(serial_num, 'to_aws'), message.payload, 1))
+		server.subscribe(registry.device_topic(serial_num, 'to_aws'), 1,
+		                 lambda client, userdata, message: loop.call_soon_threadsafe(replies.put_nowait, time.perf_counter()))
+		await asyncio.sleep(0.5)
+		rtt = []
+		for cmd_id in range(count):
+			start = time.perf_counter()
+			server.publish(registry.device_topic(serial_num, 'from_aws'), json.dumps({'request': ['weight'], 'id': cmd_id}), 1)
+			rtt.append(await replies.get() - start)
+		report("broker", rtt)
+	device.close()
+
+
+if(__name__ == "__main__"):
+	import argparse
+	parser = argparse.ArgumentParser(description="Compare command round trips over the LAN and through a broker")
+	parser.add_argument('-b', '--broker', help="host:port of a local MQTT broker")
+	parser.add_argument('-n', '--count', type=int, default=1000)
+	args = parser.parse_args()
+	asyncio.run(bench(args.count, args.broker))
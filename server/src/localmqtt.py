@@ -0,0 +1,49 @@
+#!/usr/bin/env python3
+
+"""
+Plain MQTT stand-in for AWSIoTMQTTClient.
+
+Speaks the subset of the AWS client API used by the server and the camera
+daemon to a local broker such as mosquitto, without TLS, so the feeder flow
+can run on one machine. Callbacks get the same (client, userdata, message)
+arguments as with the AWS client.
+"""
+
+import paho.mqtt.client as mqtt
+
+
+class LocalMQTTClient:
+
+	def __init__(self, client_id):
+		if(hasattr(mqtt, 'CallbackAPIVersion')):
+			# paho-mqtt 2 takes the callback API version first; message
+			# callbacks, the only ones used here, are the same in both
+			self.client = mqtt.Client(mqtt.CallbackAPIVersion.VERSION2, client_id)
+		else:
+			self.client = mqtt.Client(client_id)
+		self.host = 'localhost'
+		self.port = 1883
+
+	def __getattr__(self, name):
+		# configureCredentials, configureOfflinePublishQueueing, ...: nothing to do
+		if(name.startswith('configure')):
+			return lambda *args: None
+		raise AttributeError(name)
+
+	def configureEndpoint(self, host, port):
+		self.host = host
+		self.port = port
+
+	def connect(self):
+		self.client.connect(self.host, self.port)
+		self.client.loop_start()
+		return True
+
+	def subscribe(self, topic, qos, callback):
+		self.client.message_callback_add(topic, lambda client, userdata, message: callback(self, userdata, message))
+		self.client.subscribe(topic, qos)
+		return True
+
+	def publish(self, topic, payload, qos):
+		self.client.publish(topic, payload, qos)
+		return True
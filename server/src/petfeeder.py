@@ -5,10 +5,36 @@ from pytz import timezone
 import json
 from AWSIoTPythonSDK.MQTTLib import AWSIoTMQTTClient
 import logging
+import threading
 import time
 
 valid_keys = ['weight','motion']
 
+root_cert = '../aws-auth/AmazonRootCA1.pem'
+private_key = '../aws-auth/951ad5141e-private.pem.key'
+cert = '../aws-auth/951ad5141e-certificate.pem.crt'
+
+# Seconds to wait for an ack before the command is sent again with the same id
+ack_timeout = 10
+max_retries = 5
+# Commands given up on per device that a late ack is still matched against
+given_up_kept = 16
+
+
+def next_cmd_id(last):
+	# The feeder keeps the ids it has seen in RTC memory across server
+	# restarts, so ids never start over: wall clock seconds are the floor,
+	# as with the LAN sequence numbers. Fits the feeder's 32 bits until 2106.
+	return max(last + 1, int(time.time()))
+
+
+def event_time(msg_json, key):
+	# Feeders with a synced clock send the batch time t and each record's
+	# age in dt, so a delayed upload keeps the time things happened
+	if('t' not in msg_json):
+		return time.time()
+	return msg_json['t'] - msg_json.get('dt', {}).get(key, 0)
+
 
 class PetFeeder:
 
@@ -22,13 +48,25 @@ class PetFeeder:
 		if(self.dispense_times == None):
 			print("Can not create PetFeeder without a dispense time list!")
 			exit(2)
-		self.root_cert = '../aws-auth/AmazonRootCA1.pem'
-		self.private_key = '../aws-auth/951ad5141e-private.pem.key'
-		self.cert = '../aws-auth/951ad5141e-certificate.pem.crt'
+		self.root_cert = root_cert
+		self.private_key = private_key
+		self.cert = cert
 		self.pub_topic = None
 		self.sub_topic = None		
 		self.time_iter = 0
 		self.ready = True
+		# Commands awaiting an ack, keyed by sequence id; next_id is the last
+		# id used. Several can be in flight at once; a retransmit reuses the
+		# id so the feeder can drop the duplicate.
+		self.next_id = 0
+		self.in_flight = {}
+		# Dispense commands given up on, by id. They are never sent again
+		# under a new id: the broker keeps them queued in the feeder's
+		# persistent session, and a feeder that comes back runs them late.
+		self.given_up = {}
+		self.lock = threading.Lock()
+		self.scheduler = None
+		self.store = None
 
 	def aws_init(self, pub_topic=None, sub_topic=None):
 		self.aws_client = AWSIoTMQTTClient('petfeeder{}@{}'.format(self.serial_num, self.ip_addr))
@@ -79,12 +117,117 @@ class PetFeeder:
 		else:
 			return False
 	
+	def dispense_portions(self, portions):
+		# portions is a list of (channel, grams); the feeder runs them back to back
+		data = {}
+		data['portions'] = [{'channel': channel, 'grams': grams} for (channel, grams) in portions]
+		return self.send_command(data)
+
+	def send_command(self, msg_json, slot=None):
+		# Tag the command with a sequence id and publish it without waiting
+		# for the previous one. slot is the dispense_times index a dispense
+		# command completes, if any.
+		with self.lock:
+			cmd_id = next_cmd_id(self.next_id)
+			self.next_id = cmd_id
+			msg_json['id'] = cmd_id
+			self.in_flight[cmd_id] = {'msg': msg_json, 'sent': time.monotonic(), 'retries': 0, 'slot': slot}
+		self.publish_msg(msg_json)
+		return cmd_id
+
+	def retransmit_expired(self):
+		now = time.monotonic()
+		with self.lock:
+			expired = [(cmd_id, cmd) for (cmd_id, cmd) in self.in_flight.items() if now - cmd['sent'] >= ack_timeout]
+			for (cmd_id, cmd) in expired:
+				if(cmd['retries'] >= max_retries):
+					print("Giving up on command {} to {}@{}".format(cmd_id, self.serial_num, self.ip_addr))
+					del self.in_flight[cmd_id]
+					if(cmd['slot'] is not None):
+						self.give_up(cmd_id, cmd)
+						self.notify_scheduler()
+				else:
+					cmd['retries'] += 1
+					cmd['sent'] = now
+		for (cmd_id, cmd) in expired:
+			if(cmd['retries'] > 0 and cmd_id in self.in_flight):
+				print("Retransmitting command {} to {}@{}".format(cmd_id, self.serial_num, self.ip_addr))
+				self.publish_msg(cmd['msg'])
+
+	def handle_ack(self, ack, t=None):
+		cmd_id = ack['id']
+		result = ack['result']
+		with self.lock:
+			cmd = self.in_flight.get(cmd_id)
+			if(cmd is None):
+				# late or duplicated ack for a command already completed; a
+				# dispense given up on may still have run
+				if(result == 'done' and self.given_up.pop(cmd_id, None) is not None):
+					print("Late dispense {} on {}@{}".format(cmd_id, self.serial_num, self.ip_addr))
+					self.record('dispense', self.dispense_amount, t)
+				return
+			if(result == 'pending'):
+				cmd['sent'] = time.monotonic()
+				return
+			del self.in_flight[cmd_id]
+		print("Command {} to {}@{}: {}".format(cmd_id, self.serial_num, self.ip_addr, result))
+		if(cmd['slot'] is None):
+			self.notify_scheduler()
+			return
+		if(result == 'done' and cmd['slot'] == self.time_iter):
+			self.record('dispense', self.dispense_amount, t)
+			self.advance_schedule()
+		else:
+			self.ready = True
+		self.notify_scheduler()
+
+	def give_up(self, cmd_id, cmd):
+		# The meal is skipped rather than sent again under a new id
+		self.given_up[cmd_id] = cmd
+		if(len(self.given_up) > given_up_kept):
+			del self.given_up[min(self.given_up)]
+		if(cmd['slot'] == self.time_iter):
+			self.advance_schedule()
+		self.ready = True
+
+	def record(self, metric, value, t=None):
+		if(self.store is not None):
+			self.store.append(self.serial_num, metric, t if t is not None else time.time(), value)
+
+	def notify_scheduler(self):
+		if(self.scheduler is not None):
+			self.scheduler.reschedule(self)
+
+	def next_dispense_deadline(self):
+		# Epoch seconds of the next dispense, or None while one is in flight
+		if(not self.ready):
+			return None
+		return self.dispense_times[self.time_iter].timestamp()
+
+	def next_retransmit_deadline(self):
+		with self.lock:
+			if(not self.in_flight):
+				return None
+			oldest = min(cmd['sent'] for cmd in self.in_flight.values())
+		return time.time() + oldest + ack_timeout - time.monotonic()
+
+	def advance_schedule(self):
+		self.time_iter += 1
+		self.ready = True
+		if(self.time_iter >= len(self.dispense_times)):
+			print("No more dispenses needed today. Adding one day to each scheduled time...")
+			for index in range(len(self.dispense_times)):
+				self.dispense_times[index] = self.dispense_times[index] + timedelta(days=1)
+			self.time_iter = 0
+
 	def publish_msg(self, msg_json):
 		print("Publishing message to {}@{}:\n{}".format(self.serial_num, self.ip_addr, json.dumps(msg_json, sort_keys=True, indent=4)))
 		self.aws_client.publish(self.pub_topic, json.dumps(msg_json), 1)
 
 	def sub_cb(self, client, userdata, message):
-		msg_json = json.loads(message.payload)
+		self.handle_msg(json.loads(message.payload))
+
+	def handle_msg(self, msg_json):
 		valid = 0;
 		t = datetime.now().astimezone(timezone('utc'))
 		print("{}: JSON received from {}@{}:\n".format(t, self.serial_num, self.ip_addr))
@@ -96,6 +239,7 @@ class PetFeeder:
 			print("{}: Bowl weight read from {}@{}: {}".format(t, self.serial_num, self.ip_addr, msg_json['weight']))
 			valid = 1
 			self.weight = msg_json['weight']
+			self.record('weight', self.weight, event_time(msg_json, 'weight'))
 		if('update' in msg_json):
 			print("{}: Schedule update read from {}@{}: {}".format(t, self.serial_num, self.ip_addr, msg_json['update']))
 			self.update_schedule(msg_json)
@@ -103,40 +247,46 @@ class PetFeeder:
 		if('status' in msg_json):
 			valid = 1
 			print("{}: Received status from {}@{}: {}".format(t, self.serial_num, self.ip_addr, msg_json['status']))
-			self.time_iter += 1
-			self.ready = True
-			if(self.time_iter >= len(self.dispense_times)):
-				print("No more dispenses needed today. Adding one day to each scheduled time...")
-				for index in range(len(self.dispense_times)):
-					self.dispense_times[index] = self.dispense_times[index] + timedelta(days=1)
-				self.time_iter = 0
+		if('ack' in msg_json):
+			valid = 1
+			for ack in msg_json['ack']:
+				self.handle_ack(ack, event_time(msg_json, 'ack') - ack.get('dt', 0))
 		if('motion' in msg_json):
 			print("{}: Motion sensor for {}@{}".format(t, self.serial_num, self.ip_addr))
+			self.record('motion', 1, event_time(msg_json, 'motion'))
+		if('bouts' in msg_json):
+			valid = 1
+			sent = event_time(msg_json, 'bouts')
+			for bout in msg_json['bouts']:
+				print("{}: {}@{} ate {g:.1f} g in {len} s, peak {peak:.1f} g/min".format(t, self.serial_num, self.ip_addr, **bout))
+				start = sent - bout['ago'] - bout['len']
+				self.record('bout', bout['g'], start)
+				self.record('bout_s', bout['len'], start)
+				self.record('bout_rate', bout['peak'], start)
+		if('clock' in msg_json):
+			valid = 1
+			print("{}: Clock of {}@{} synced, offset {offset_ms} ms, drift {drift_ppm} ppm".format(t, self.serial_num, self.ip_addr, **msg_json['clock']))
+			self.record('clock_drift', msg_json['clock']['drift_ppm'], event_time(msg_json, 'clock'))
+		if('journal' in msg_json):
+			# batches the feeder kept in flash while it was offline
+			valid = 1
+			for batch in msg_json['journal']:
+				self.handle_msg(batch)
 		if(valid == 0):
 			print("Invalid json:\n{}".format(json.dumps(msg_json, sort_keys=True, indent=4)))
 
 if(__name__ == "__main__"):
+	import asyncio
+	from scheduler import Scheduler
+
 	tmp = datetime.now().astimezone(timezone('US/Central'))
 	disp_time = [tmp + timedelta(seconds=5), tmp + timedelta(seconds=50)]
 	uut = PetFeeder(ip_addr='a2ot5vs3yt7xtc-ats.iot.us-west-2.amazonaws.com', serial_num='12345', port=8883, dispense_amount=100, weight=0, dispense_times=disp_time)
 	print("Creating new pet-feeder for {}:{}".format(uut.ip_addr, uut.port))
-	uut.aws_init(sub_topic="pet-feeder/to_aws", pub_topic="pet-feeder/from_aws")
-	prev = datetime.now().astimezone(timezone('utc'))
-
-	while True:
-		delta = datetime.now().astimezone(timezone('utc')) - prev
-		if(uut.is_dispense_time()):
-			print("Dipsense time!")
-			json_string = "{\"request\":[\"dispense\",\"weight\"]}"
-			data = json.loads(json_string)
-			print("String: {}".format(json_string))
-			print("JSON: {}".format(json.dumps(data, sort_keys=True, indent=4)))
-			uut.publish_msg(data)
-		elif(delta.total_seconds() >= 60):
-			print("Requesting information from pet-feeder")
-			prev = datetime.now().astimezone(timezone('utc'))
-			json_string = "{\"request\":[\"weight\"]}"
-			data = json.loads(json_string)
-			uut.publish_msg(data)
-		time.sleep(0.5)
+	uut.aws_init(sub_topic="pet-feeder/{}/to_aws".format(uut.serial_num), pub_topic="pet-feeder/{}/from_aws".format(uut.serial_num))
 
+	loop = asyncio.new_event_loop()
+	asyncio.set_event_loop(loop)
+	sched = Scheduler(loop)
+	sched.add_device(uut)
+	loop.run_until_complete(sched.run())
@@ -0,0 +1,104 @@
+#!/usr/bin/env python3
+
+"""
+Closed-loop portion controller.
+
+Before each scheduled dispense the bowl weight is what the pet left of the
+previous meal, so the grams eaten are the previous leftover plus the
+previous portion minus the new leftover. When the pet left food, that is
+its appetite and is folded into an EWMA. When it emptied the bowl its
+appetite is unknown, so the portion is probed upwards.
+
+The portion tracks the appetite, corrected by a fraction `gain` of the
+distance between the last leftover and `target_leftover`, clamped to the
+bounds the vet set for the pet. The step is kept small so one correction
+does not overshoot into the opposite one. A new portion is pushed to the
+feeder only when it differs from the current one by more than the deadband,
+which keeps message traffic down and stops the portion from hunting around
+its set point. Once the leftover is back within `snap` grams of the target
+the deadband narrows to `fine` grams, so the portion settles on the
+appetite instead of stopping a few grams off it and letting the leftover
+creep away again.
+
+A cut made because the pet left food is followed by `hold` meals without
+probing: the bowl may be emptied while the leftover is drawn down, and that
+is not a sign the pet wants more.
+"""
+
+
+class PortionBounds:
+
+	def __init__(self, min_portion, max_portion, target_leftover=5):
+		self.min_portion = min_portion
+		self.max_portion = max_portion
+		self.target_leftover = target_leftover
+
+
+class PortionController:
+
+	def __init__(self, gain=0.3, smoothing=0.3, probe=0.1, deadband=4, deadband_ratio=0.05, empty=1, snap=2, fine=2, hold=3):
+		self.gain = gain
+		self.smoothing = smoothing
+		self.probe = probe
+		self.deadband = deadband
+		self.deadband_ratio = deadband_ratio
+		self.empty = empty
+		self.snap = snap
+		self.fine = fine
+		self.hold = hold
+		self.bounds = {}
+		# device -> [appetite, last portion, last leftover, meals left without probing]
+		self.state = {}
+
+	def set_bounds(self, device, bounds):
+		self.bounds[device] = bounds
+
+	def on_meal(self, device, portion, leftover):
+		"""Returns the new portion for device, or None to keep the current one."""
+		bounds = self.bounds.get(device)
+		if(bounds is None or leftover is None):
+			return None
+		leftover = max(0.0, float(leftover))
+		state = self.state.get(device)
+		if(state is None):
+			self.state[device] = [None, portion, leftover, 0]
+			return None
+		(appetite, last_portion, last_leftover, hold) = state
+		eaten = max(0.0, last_leftover + last_portion - leftover)
+		satiated = leftover > self.empty
+		if(satiated):
+			appetite = eaten if appetite is None else appetite + self.smoothing * (eaten - appetite)
+		else:
+			appetite = eaten if appetite is None else max(appetite, eaten)
+		target = appetite if(satiated or hold) else appetite * (1 + self.probe)
+		target += self.gain * (bounds.target_leftover - leftover)
+
+		target = int(round(min(bounds.max_portion, max(bounds.min_portion, target))))
+		if(satiated and abs(leftover - bounds.target_leftover) <= self.snap):
+			changed = abs(target - portion) >= self.fine
+		else:
+			changed = abs(target - portion) > max(self.deadband, self.deadband_ratio * portion)
+		if(changed and satiated and target < portion):
+			hold = self.hold
+		else:
+			hold = max(0, hold - 1)
+		self.state[device] = [appetite, target if changed else portion, leftover, hold]
+		return target if changed else None
+
+
+if(__name__ == "__main__"):
+	# Simulate a cat whose appetite changes from 55 g to 80 g a meal
+	ctl = PortionController()
+	ctl.set_bounds('cat', PortionBounds(30, 120))
+	portion = 100
+	leftover = 0
+	updates = 0
+	for meal in range(40):
+		new = ctl.on_meal('cat', portion, leftover)
+		if(new is not None):
+			portion = new
+			updates += 1
+		appetite = 55 if meal < 20 else 80
+		leftover = max(0, leftover + portion - appetite)
+		print("meal {:2d}: portion {:3d} g, leftover {:3d} g".format(meal, portion, leftover))
+	print("{} updates in 40 meals".format(updates))
@@ -0,0 +1,670 @@
+#!/usr/bin/env python3
+
+"""
+Fleet device registry for the scheduler.
+
+Device state is kept column-wise in typed arrays indexed by row, so a
+device costs a few dozen bytes instead of a PetFeeder object with its own
+MQTT client. Devices are sharded across worker processes by serial number
+and every shard publishes to its devices over its own broker connection.
+Only one connection subscribes, with wildcards on pet-feeder/+/...: the
+Demux in the parent process hashes the serial number in each topic and
+hands the message to the owning shard over a pipe, so a message is
+delivered and parsed once rather than once per shard.
+
+Feeders spend most of their time in deep sleep and reconnect on a timer.
+The period is learned from the gaps between wakes (the first message after
+a silence). Commands for a sleeping device are held and published as one
+burst just before its next wake, and the broker's persistent session
+delivers them as it reconnects. A newer command replaces a held one of the
+same kind. Urgent commands and devices whose cycle is not known yet skip
+the hold.
+
+Devices with a LAN key are also discovered on the local network every time
+they wake, and commands go to them directly while they are awake (see
+lan.py). Retransmissions always go through the broker.
+
+At every scheduled meal the grams eaten at the previous one (served less
+the leftover) are stored as "eaten" and fed to the diet detector
+(automated_functions/auto_adjustment/adjust.py). A meal out of line with
+the pet's history is published on pet-feeder/<serial>/alert as
+	{"diet": "Pet eats too much", "eaten": 82.5, "t": <epoch s>}
+For devices behind an edge gateway the gateway works out dispensed and
+eaten grams and forwards them in its batches; they are judged here the
+same way.
+"""
+
+from array import array
+from datetime import datetime, timedelta
+import asyncio
+import bisect
+import json
+import multiprocessing
+import os
+import sys
+import time
+import zlib
+
+from pytz import timezone
+
+import petfeeder
+from gate import IdentityGate, PetPortion
+from lan import LanChannel
+from portion import PortionBounds, PortionController
+from scheduler import Scheduler
+from tsdb import TimeSeriesStore
+
+TOPIC_PREFIX = 'pet-feeder'
+# Topic leaves devices publish on; edge gateways add <site>/batch
+device_leaves = ('to_aws', 'motion', 'identity')
+
+# A message this long after the previous one starts a new wake
+wake_gap = 2.5
+# Publish held commands this long before the predicted wake
+wake_lead = 2.0
+# A device that has been silent for this many periods is not tracked; its
+# commands go straight to the broker
+offline_periods = 5
+
+# Upper edges (ms) of the motion to dispense latency histogram
+latency_buckets = (250, 500, 750, 1000, 1500, 2000, 3000)
+
+
+def device_topic(serial_num, leaf):
+	return "{}/{}/{}".format(TOPIC_PREFIX, serial_num, leaf)
+
+
+def shard_of(serial_num, num_shards):
+	return zlib.crc32(str(serial_num).encode()) % num_shards
+
+
+class DeviceRegistry:
+	# A scheduler fleet whose devices are row numbers
+
+	def __init__(self, client=None, store=None, controller=None, gate=None, diet=None):
+		self.client = client
+		self.store = store
+		self.controller = controller
+		self.gate = gate
+		# adjust.DietDetector fed with the grams eaten at every meal
+		self.diet = diet
+		# row -> grams in the bowl once the dispense in flight is done, and
+		# once the last meal was served with its time
+		self.serving = {}
+		self.served = {}
+		self.diet_alerts = 0
+		self.scheduler = None
+		# LanChannel when any device of the shard has a LAN key
+		self.lan = None
+		self.rows = {}
+		self.serial_num = []
+		self.dispense_amount = array('i')
+		self.weight = array('f')
+		self.time_iter = array('H')
+		self.ready = array('b')
+		# Last command id sent to each device
+		self.next_id = array('L')
+		self.last_seen = array('d')
+		self.last_wake = array('d')
+		# Learned wake period in seconds, 0 until two wakes have been seen
+		self.wake_period = array('f')
+		# Dispense times of every device, flattened; row r owns
+		# times[sched_start[r]:sched_start[r] + sched_len[r]]
+		self.times = array('d')
+		self.sched_start = array('L')
+		self.sched_len = array('H')
+		# Only rows with outstanding commands have an entry here
+		self.in_flight = {}
+		# row -> {id: command} for dispenses given up on, never re-issued
+		# under a new id (see PetFeeder.given_up)
+		self.given_up = {}
+		# row -> {kind: (message, slot)} waiting for the device's next wake
+		self.held = {}
+		# row -> {"deadband": grams, "interval": s} for devices that report
+		# weight by exception instead of being polled
+		self.reporting = {}
+		self.bursts = 0
+		self.superseded = 0
+		self.motion_hist = array('L', [0] * (len(latency_buckets) + 1))
+		# Retransmissions, and acks for commands that had already completed:
+		# the device got the command more than once, so the retry was redundant
+		self.retransmits = 0
+		self.redundant = 0
+		# Dispenses given up on, and those acked done afterwards
+		self.abandoned = 0
+		self.late = 0
+		# Topic leaf -> handler(row, msg_json)
+		self.handlers = dict(zip(device_leaves, (self.on_status, self.on_motion, self.on_identity)))
+
+	def __len__(self):
+		return len(self.serial_num)
+
+	def add(self, serial_num, dispense_times, dispense_amount=0):
+		row = len(self.serial_num)
+		self.rows[str(serial_num)] = row
+		self.serial_num.append(str(serial_num))
+		self.dispense_amount.append(dispense_amount)
+		self.weight.append(0)
+		self.time_iter.append(0)
+		self.ready.append(1)
+		self.next_id.append(0)
+		self.last_seen.append(0)
+		self.last_wake.append(0)
+		self.wake_period.append(0)
+		self.sched_start.append(len(self.times))
+		self.sched_len.append(len(dispense_times))
+		self.times.extend(t.timestamp() for t in dispense_times)
+		return row
+
+	def subscribe(self):
+		for leaf in self.handlers:
+			self.client.subscribe(device_topic('+', leaf), 1, self.on_message)
+		self.client.subscribe(device_topic('+', 'batch'), 1, self.on_message)
+
+	def on_message(self, client, userdata, message):
+		# Runs on the MQTT client thread; hand over to the event loop
+		self.scheduler.loop.call_soon_threadsafe(self.route, message.topic, message.payload)
+
+	def listen(self, loop, conn):
+		# Instead of subscribing: read what the Demux hands over on the event
+		# loop itself
+		loop.add_reader(conn.fileno(), self.on_pipe, loop, conn)
+
+	def on_pipe(self, loop, conn):
+		try:
+			while(conn.poll()):
+				(topic, payload) = conn.recv()
+				if(topic is None):
+					# this shard's part of a gateway batch, already parsed
+					self.on_batch({'msgs': payload})
+				else:
+					self.route(topic, payload)
+		except EOFError:
+			print("Demux gone, no more messages")
+			loop.remove_reader(conn.fileno())
+
+	def route(self, topic, payload):
+		# pet-feeder/<serial>/<leaf>: the device and message kind come from
+		# the topic, so foreign and uninteresting messages are never parsed
+		(_, serial_num, leaf) = topic.split('/', 2)
+		if(leaf == 'batch'):
+			self.on_batch(json.loads(payload))
+			return
+		row = self.rows.get(serial_num)
+		handler = self.handlers.get(leaf)
+		if(row is None or handler is None):
+			# another shard's device
+			return
+		handler(row, json.loads(payload))
+
+	def on_batch(self, batch):
+		# Telemetry forwarded by an edge gateway (gateway.py); every shard
+		# takes its own devices
+		for (serial_num, leaf, msg_json) in batch['msgs']:
+			row = self.rows.get(serial_num)
+			if(row is None):
+				continue
+			if(leaf == 'record'):
+				self.on_record(row, msg_json)
+				continue
+			# the gateway sent these commands and has handled the acks; only
+			# the outcome is kept here
+			for ack in msg_json.pop('ack', ()):
+				self.record(row, 'ack', 1 if ack['result'] == 'done' else 0, petfeeder.event_time(msg_json, 'ack') - ack.get('dt', 0))
+			handler = self.handlers.get(leaf)
+			if(handler is not None and msg_json):
+				handler(row, msg_json)
+
+	def on_record(self, row, msg_json):
+		# Worked out by the gateway, which runs the device's schedule
+		self.record(row, msg_json['metric'], msg_json['value'], msg_json['t'])
+		if(msg_json['metric'] == 'eaten'):
+			self.judge_meal(row, msg_json['value'], msg_json['t'])
+
+	def on_status(self, row, msg_json):
+		self.seen(row)
+		if('weight' in msg_json):
+			self.weight[row] = msg_json['weight']
+			self.record(row, 'weight', msg_json['weight'], petfeeder.event_time(msg_json, 'weight'))
+		if('bouts' in msg_json):
+			sent = petfeeder.event_time(msg_json, 'bouts')
+			for bout in msg_json['bouts']:
+				start = sent - bout['ago'] - bout['len']
+				self.record(row, 'bout', bout['g'], start)
+				self.record(row, 'bout_s', bout['len'], start)
+				self.record(row, 'bout_rate', bout['peak'], start)
+		if('clock' in msg_json):
+			self.record(row, 'clock_drift', msg_json['clock']['drift_ppm'], petfeeder.event_time(msg_json, 'clock'))
+		if('motion_ms' in msg_json):
+			self.motion_hist[bisect.bisect_left(latency_buckets, msg_json['motion_ms'])] += 1
+			self.record(row, 'motion_latency', msg_json['motion_ms'])
+		for ack in msg_json.get('ack', ()):
+			self.handle_ack(row, ack, petfeeder.event_time(msg_json, 'ack') - ack.get('dt', 0))
+		if('motion' in msg_json):
+			# only batches kept while the feeder was offline carry motion
+			self.record(row, 'motion', 1, petfeeder.event_time(msg_json, 'motion'))
+		for batch in msg_json.get('journal', ()):
+			self.on_status(row, batch)
+
+	def on_motion(self, row, msg_json):
+		self.seen(row)
+		print("Motion sensor for {}".format(self.serial_num[row]))
+		self.record(row, 'motion', 1, petfeeder.event_time(msg_json, 'motion'))
+
+	def on_identity(self, row, msg_json):
+		if(self.gate is None):
+			return
+		(closed, fed) = self.gate.on_identity(self.serial_num[row], msg_json)
+		if(fed):
+			self.send_command(row, {'portions': [{'channel': p.channel, 'grams': p.grams} for (_, p) in fed]}, urgent=True)
+			self.record(row, 'dispense', sum(p.grams for (_, p) in fed))
+		if(closed):
+			self.close_meal(row)
+
+	def seen(self, row):
+		now = time.time()
+		if(now - self.last_seen[row] > wake_gap):
+			last = self.last_wake[row]
+			period = self.wake_period[row]
+			if(last and (not period or now - last < offline_periods * period)):
+				self.wake_period[row] = now - last if not period else period + 0.2 * (now - last - period)
+			self.last_wake[row] = now
+			if(self.lan is not None):
+				self.lan.discover(self.serial_num[row])
+		self.last_seen[row] = now
+		if(row in self.held):
+			self.scheduler._reschedule(row)
+
+	def asleep(self, row):
+		period = self.wake_period[row]
+		if(not period):
+			return False
+		since = time.time() - self.last_wake[row]
+		return time.time() - self.last_seen[row] >= wake_gap and since < offline_periods * period
+
+	def latency_report(self):
+		edges = ["<={}".format(ms) for ms in latency_buckets] + [">{}".format(latency_buckets[-1])]
+		return "motion to dispense ms: " + '  '.join("{} {}".format(e, n) for (e, n) in zip(edges, self.motion_hist))
+
+	def close_meal(self, row):
+		self.advance_schedule(row)
+		self.ready[row] = 1
+		self.scheduler._reschedule(row)
+
+	def record(self, row, metric, value, t=None):
+		if(self.store is not None):
+			self.store.append(self.serial_num[row], metric, t if t is not None else time.time(), value)
+
+	# Scheduler fleet interface
+
+	def attach(self, row, scheduler):
+		self.scheduler = scheduler
+
+	def name(self, row):
+		return self.serial_num[row]
+
+	def is_dispense_time(self, row):
+		if(self.gate is not None and self.gate.expired(self.serial_num[row])):
+			self.close_meal(row)
+			return False
+		if(not self.ready[row]):
+			return False
+		if(time.time() >= self.times[self.sched_start[row] + self.time_iter[row]]):
+			self.ready[row] = 0
+			return True
+		return False
+
+	def dispense(self, row):
+		if(self.gate is not None and self.gate.is_gated(self.serial_num[row])):
+			# portions go out per pet as the camera recognizes them
+			print("Meal armed for {}".format(self.serial_num[row]))
+			self.gate.arm(self.serial_num[row])
+			return
+		# the bowl weight before dispensing is the previous meal's leftover
+		self.check_diet(row, self.weight[row])
+		if(self.controller is not None):
+			portion = self.controller.on_meal(self.serial_num[row], self.dispense_amount[row], self.weight[row])
+			if(portion is not None):
+				self.dispense_amount[row] = portion
+				self.send_command(row, {'update': portion})
+		self.serving[row] = self.weight[row] + self.dispense_amount[row]
+		self.send_command(row, {'request': ['dispense', 'weight']}, slot=self.time_iter[row])
+
+	def check_diet(self, row, leftover):
+		# The pet ate what was served at the last meal less what is left of it
+		served = self.served.pop(row, None)
+		if(served is None):
+			return
+		(grams, t) = served
+		eaten = max(0.0, grams - leftover)
+		self.record(row, 'eaten', eaten, t)
+		self.judge_meal(row, eaten, t)
+
+	def judge_meal(self, row, eaten, t):
+		if(self.diet is None):
+			return
+		import adjust
+		verdict = self.diet.update(self.serial_num[row], t, eaten)
+		if(verdict != adjust.NORMAL):
+			self.diet_alerts += 1
+			print("{}: {}, {:.0f} g eaten".format(self.serial_num[row], verdict, eaten))
+			self.client.publish(device_topic(self.serial_num[row], 'alert'), json.dumps({'diet': verdict, 'eaten': round(eaten, 1), 't': t}), 1)
+
+	def polled(self, row):
+		return row not in self.reporting
+
+	def report_by_exception(self, row, report):
+		self.reporting[row] = report
+		self.send_command(row, {'report': report})
+
+	def poll(self, row):
+		self.send_command(row, {'request': ['weight']})
+
+	def next_dispense_deadline(self, row):
+		if(not self.ready[row]):
+			# an open meal is due to close when its window runs out
+			return self.gate.closes(self.serial_num[row]) if self.gate is not None else None
+		return self.times[self.sched_start[row] + self.time_iter[row]]
+
+	def next_retransmit_deadline(self, row):
+		pending = self.in_flight.get(row)
+		if(not pending):
+			return None
+		oldest = min(cmd[1] for cmd in pending.values())
+		return time.time() + oldest + petfeeder.ack_timeout - time.monotonic()
+
+	def next_wake_deadline(self, row):
+		if(row not in self.held):
+			return None
+		if(not self.asleep(row)):
+			return time.time()
+		return max(time.time(), self.last_wake[row] + self.wake_period[row] - wake_lead)
+
+	def release(self, row):
+		held = self.held.pop(row, None)
+		if(held):
+			self.bursts += 1
+			for (msg_json, slot) in held.values():
+				self.dispatch(row, msg_json, slot)
+
+	def retransmit_expired(self, row):
+		now = time.monotonic()
+		pending = self.in_flight.get(row, {})
+		for (cmd_id, cmd) in list(pending.items()):
+			if(now - cmd[1] < petfeeder.ack_timeout):
+				continue
+			if(cmd[2] >= petfeeder.max_retries):
+				print("Giving up on command {} to {}".format(cmd_id, self.serial_num[row]))
+				del pending[cmd_id]
+				if(cmd[3] is not None):
+					self.give_up(row, cmd_id, cmd)
+			else:
+				cmd[1] = now
+				cmd[2] += 1
+				self.retransmits += 1
+				self.publish(row, cmd[0], lan=False)
+		if(not pending):
+			self.in_flight.pop(row, None)
+
+	def give_up(self, row, cmd_id, cmd):
+		# The meal is skipped rather than sent again under a new id
+		self.abandoned += 1
+		given_up = self.given_up.setdefault(row, {})
+		given_up[cmd_id] = cmd
+		if(len(given_up) > petfeeder.given_up_kept):
+			del given_up[min(given_up)]
+		if(cmd[3] == self.time_iter[row]):
+			self.advance_schedule(row)
+		self.ready[row] = 1
+
+	# Commands
+
+	def send_command(self, row, msg_json, slot=None, urgent=False):
+		if(not urgent and self.asleep(row)):
+			self.hold(row, msg_json, slot)
+		else:
+			self.dispatch(row, msg_json, slot)
+
+	def hold(self, row, msg_json, slot):
+		# The latest update wins; a request already waiting is not repeated
+		kind = 'update' if 'update' in msg_json else json.dumps(msg_json, sort_keys=True)
+		held = self.held.setdefault(row, {})
+		if(kind in held):
+			self.superseded += 1
+			if(kind != 'update'):
+				return
+		held[kind] = (msg_json, slot)
+		self.scheduler._reschedule(row)
+
+	def dispatch(self, row, msg_json, slot=None):
+		cmd_id = petfeeder.next_cmd_id(self.next_id[row])
+		self.next_id[row] = cmd_id
+		msg_json['id'] = cmd_id
+		# [message, sent, retries, slot]
+		self.in_flight.setdefault(row, {})[cmd_id] = [msg_json, time.monotonic(), 0, slot]
+		self.publish(row, msg_json)
+		return cmd_id
+
+	def publish(self, row, msg_json, lan=True):
+		if(lan and self.lan is not None and self.lan.send(self.serial_num[row], msg_json)):
+			return
+		self.client.publish(device_topic(self.serial_num[row], 'from_aws'), json.dumps(msg_json), 1)
+
+	def handle_ack(self, row, ack, t=None):
+		pending = self.in_flight.get(row)
+		cmd = pending.get(ack['id']) if pending else None
+		if(cmd is None):
+			late = self.given_up.get(row)
+			if(ack['result'] == 'done' and late and late.pop(ack['id'], None) is not None):
+				print("Late dispense {} on {}".format(ack['id'], self.serial_num[row]))
+				self.late += 1
+				self.record(row, 'dispense', self.dispense_amount[row], t)
+				return
+			self.redundant += 1
+			return
+		if(ack['result'] == 'pending'):
+			cmd[1] = time.monotonic()
+			return
+		del pending[ack['id']]
+		if(not pending):
+			del self.in_flight[row]
+		if(cmd[3] is not None):
+			if(ack['result'] == 'done' and cmd[3] == self.time_iter[row]):
+				self.record(row, 'dispense', self.dispense_amount[row], t)
+				if(row in self.serving):
+					self.served[row] = (self.serving.pop(row), t if t is not None else time.time())
+				self.advance_schedule(row)
+			self.ready[row] = 1
+		self.scheduler._reschedule(row)
+
+	def advance_schedule(self, row):
+		it = self.time_iter[row] + 1
+		if(it >= self.sched_len[row]):
+			start = self.sched_start[row]
+			for index in range(start, start + self.sched_len[row]):
+				self.times[index] += 86400
+			it = 0
+		self.time_iter[row] = it
+
+
+class Demux:
+	# The one subscriber for the whole fleet. Runs on the MQTT client thread
+	# and looks at nothing but the topic, except for gateway batches, which
+	# are split by shard. A shard that falls behind fills its pipe and holds
+	# the others up rather than buffering without bound.
+
+	def __init__(self, client, conns):
+		self.client = client
+		# shard -> sending end of its pipe
+		self.conns = conns
+		self.forwarded = 0
+
+	def subscribe(self):
+		for leaf in device_leaves + ('batch',):
+			self.client.subscribe(device_topic('+', leaf), 1, self.on_message)
+
+	def on_message(self, client, userdata, message):
+		(_, serial_num, leaf) = message.topic.split('/', 2)
+		self.forwarded += 1
+		if(leaf != 'batch'):
+			self.conns[shard_of(serial_num, len(self.conns))].send((message.topic, message.payload))
+			return
+		shards = {}
+		for msg in json.loads(message.payload)['msgs']:
+			shards.setdefault(shard_of(msg[0], len(self.conns)), []).append(msg)
+		for (shard, msgs) in shards.items():
+			self.conns[shard].send((None, msgs))
+
+
+def load_devices(path):
+	# [{"serial_num": "12345", "dispense_amount": 40, "times": ["08:00", "18:30"], "timezone": "US/Central",
+	#   "portion_bounds": [30, 120], "pets": {"Cat1": {"channel": 0, "grams": 40}}, "lan_key": "<64 hex digits>"}, ...]
+	# Devices with portion_bounds have their portion adjusted automatically.
+	# Devices with pets only dispense to the pets the camera recognizes.
+	# Devices with lan_key are also controlled over the local network.
+	# Devices with "report": {"deadband": 2.5, "interval": 3600} send their
+	# weight when it moves by the deadband (grams) or the interval (s) runs
+	# out, and are not polled.
+	# Devices with "gateway": "<site>" are scheduled by that site's edge
+	# gateway; here they only get their telemetry stored.
+	with open(path) as f:
+		return json.load(f)
+
+
+def todays_times(device):
+	tz = timezone(device.get('timezone', 'utc'))
+	now = datetime.now().astimezone(tz)
+	times = []
+	for hhmm in device['times']:
+		(hour, minute) = (int(x) for x in hhmm.split(':'))
+		t = tz.localize(datetime(now.year, now.month, now.day, hour, minute))
+		times.append(t if t >= now else t + timedelta(days=1))
+	return sorted(times)
+
+
+def flush_periodically(loop, store, interval=300):
+	# The buffers are handed over here; encoding and writing them runs on a
+	# worker thread so the scheduler keeps going
+	loop.run_in_executor(None, store.write, store.take())
+	loop.call_later(interval, flush_periodically, loop, store, interval)
+
+
+def open_client(client_id, endpoint, port, broker=None):
+	if(broker):
+		from localmqtt import LocalMQTTClient
+		client = LocalMQTTClient(client_id)
+		(endpoint, port) = broker.split(':')
+		port = int(port)
+	else:
+		client = petfeeder.AWSIoTMQTTClient(client_id)
+	client.configureEndpoint(endpoint, port)
+	client.configureCredentials(petfeeder.root_cert, petfeeder.private_key, petfeeder.cert)
+	client.configureAutoReconnectBackoffTime(1, 32, 20)
+	client.configureOfflinePublishQueueing(-1)
+	client.configureDrainingFrequency(50)
+	client.configureConnectDisconnectTimeout(10)
+	client.configureMQTTOperationTimeout(5)
+	return client
+
+
+def add_device(reg, sched, device, lan_keys):
+	row = reg.add(device['serial_num'], todays_times(device), device.get('dispense_amount', 0))
+	if('portion_bounds' in device):
+		reg.controller.set_bounds(str(device['serial_num']), PortionBounds(*device['portion_bounds']))
+	if('pets' in device):
+		reg.gate.set_pets(str(device['serial_num']), {name: PetPortion(p['channel'], p['grams']) for (name, p) in device['pets'].items()})
+	if('lan_key' in device):
+		lan_keys[str(device['serial_num'])] = bytes.fromhex(device['lan_key'])
+	if('report' in device):
+		reg.report_by_exception(row, device['report'])
+	sched.add_device(row)
+
+
+def open_lan(loop, reg, lan_keys):
+	if(lan_keys):
+		(_, reg.lan) = loop.run_until_complete(loop.create_datagram_endpoint(
+			lambda: LanChannel(lan_keys, lambda serial_num, payload: reg.route(device_topic(serial_num, 'to_aws'), payload)),
+			local_addr=('0.0.0.0', 0)))
+
+
+def open_diet(store, serials):
+	"""DietDetector primed with the meals eaten so far."""
+	# automated_functions/auto_adjustment/adjust.py, which needs numpy
+	sys.path.append(os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', '..', 'automated_functions', 'auto_adjustment'))
+	import adjust
+	diet = adjust.DietDetector(capacity=max(16, len(serials)))
+	for serial_num in serials:
+		(times, grams) = store.scan(serial_num, 'eaten')
+		if(len(times)):
+			diet.backfill([serial_num] * len(times), times, grams)
+	return diet
+
+
+def run_shard(shard, num_shards, devices, endpoint, port, data_dir, broker=None, conn=None):
+	# conn is the receiving end of the shard's pipe from the Demux; without
+	# one the shard subscribes for itself
+	client = open_client('petfeeder-shard{}'.format(shard), endpoint, port, broker)
+
+	loop = asyncio.new_event_loop()
+	asyncio.set_event_loop(loop)
+	store = TimeSeriesStore(data_dir)
+	controller = PortionController()
+	gate = IdentityGate()
+	reg = DeviceRegistry(client, store, controller, gate)
+	sched = Scheduler(loop, fleet=reg)
+	lan_keys = {}
+	edge = 0
+	for device in devices:
+		if(shard_of(device['serial_num'], num_shards) != shard):
+			continue
+		if('gateway' in device):
+			reg.add(device['serial_num'], [])
+			edge += 1
+		else:
+			add_device(reg, sched, device, lan_keys)
+	print("Shard {}/{}: {} devices, {} on the LAN, {} behind gateways".format(shard, num_shards, len(reg), len(lan_keys), edge))
+	reg.diet = open_diet(store, reg.serial_num)
+	open_lan(loop, reg, lan_keys)
+	client.connect()
+	if(conn is None):
+		reg.subscribe()
+	else:
+		reg.listen(loop, conn)
+	flush_periodically(loop, store)
+	try:
+		loop.run_until_complete(sched.run())
+	finally:
+		store.close()
+		print("{} retransmits, {} redundant, {} dispenses given up ({} done late)".format(reg.retransmits, reg.redundant, reg.abandoned, reg.late))
+		print("{} bursts, {} held commands superseded".format(reg.bursts, reg.superseded))
+		print(reg.latency_report())
+		print("{} diet alerts".format(reg.diet_alerts))
+		if(reg.lan is not None):
+			print("{} commands over the LAN, {} LAN packets dropped".format(reg.lan.sent, reg.lan.dropped))
+		if(gate.decisions):
+			print(gate.report())
+
+
+if(__name__ == "__main__"):
+	import argparse
+	parser = argparse.ArgumentParser(description="Run the dispense scheduler for a fleet of feeders")
+	parser.add_argument('devices', help="JSON file listing the feeders")
+	parser.add_argument('-s', '--shards', type=int, default=multiprocessing.cpu_count())
+	parser.add_argument('-e', '--endpoint', default='a2ot5vs3yt7xtc-ats.iot.us-west-2.amazonaws.com')
+	parser.add_argument('-p', '--port', type=int, default=8883)
+	parser.add_argument('-d', '--data', default='../telemetry', help="telemetry store directory")
+	parser.add_argument('-b', '--broker', help="host:port of a local MQTT broker to use instead of AWS IoT")
+	args = parser.parse_args()
+
+	devices = load_devices(args.devices)
+	# (receiving end, sending end) per shard; a single shard subscribes itself
+	pipes = [multiprocessing.Pipe(duplex=False) for _ in range(args.shards)] if args.shards > 1 else [(None, None)]
+	workers = [multiprocessing.Process(target=run_shard, args=(shard, args.shards, devices, args.endpoint, args.port, args.data, args.broker, pipes[shard][0])) for shard in range(args.shards)]
+	for worker in workers:
+		worker.start()
+	if(args.shards > 1):
+		demux = Demux(open_client('petfeeder-demux', args.endpoint, args.port, args.broker), [send for (_, send) in pipes])
+		demux.client.connect()
+		demux.subscribe()
+	for worker in workers:
+		worker.join()
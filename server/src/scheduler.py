@@ -0,0 +1,292 @@
+#!/usr/bin/env python3
+
+"""
+Event loop scheduler for many PetFeeder devices.
+
+Each device has at most one live deadline per timer kind (dispense, poll,
+retransmit, wake) in a heap ordered by time. The loop sleeps until the
+earliest deadline or until a deadline is moved, so an idle fleet costs
+nothing.
+Moving a deadline pushes a new entry and bumps the device's generation for
+that kind; stale entries are dropped when they reach the top of the heap.
+Setting a deadline to where it already is does nothing, so acks and polls
+that leave it in place don't fill the heap with stale entries, and the heap
+is rebuilt without them once they outnumber the live ones.
+
+Devices are opaque keys; a fleet object owns their state and knows how to
+talk to them. FeederFleet drives PetFeeder objects, registry.DeviceRegistry
+drives rows of a columnar table.
+
+Benchmark with simulated feeders that ack every command, in process or
+through a local broker:
+	./scheduler.py -r -n 10000
+	mosquitto -p 1883 & ./scheduler.py -n 10000 -b localhost:1883
+"""
+
+import asyncio
+import heapq
+import itertools
+import json
+import time
+
+import petfeeder
+
+DISPENSE = 0
+POLL = 1
+RETRANSMIT = 2
+WAKE = 3
+
+poll_interval = 60
+# Deadlines closer than this are the same; the registry derives some from
+# the monotonic clock, so they jitter from one call to the next
+deadline_slack = 0.001
+
+
+class FeederFleet:
+	# Each device is a PetFeeder with its own MQTT client
+
+	def __init__(self, controller=None):
+		self.controller = controller
+
+	def attach(self, device, scheduler):
+		device.scheduler = scheduler
+
+	def name(self, device):
+		return "{}@{}".format(device.serial_num, device.ip_addr)
+
+	def is_dispense_time(self, device):
+		return device.is_dispense_time()
+
+	def dispense(self, device):
+		if(self.controller is not None):
+			# the bowl weight before dispensing is the previous meal's leftover
+			portion = self.controller.on_meal(device.serial_num, device.dispense_amount, device.weight)
+			if(portion is not None):
+				print("Changing food dispense amount for {}: {}".format(self.name(device), portion))
+				device.dispense_amount = portion
+				device.send_command({'update': portion})
+		device.send_command({'request': ['dispense', 'weight']}, slot=device.time_iter)
+
+	def polled(self, device):
+		return True
+
+	def poll(self, device):
+		device.send_command({'request': ['weight']})
+
+	def retransmit_expired(self, device):
+		device.retransmit_expired()
+
+	def next_dispense_deadline(self, device):
+		return device.next_dispense_deadline()
+
+	def next_retransmit_deadline(self, device):
+		return device.next_retransmit_deadline()
+
+	def next_wake_deadline(self, device):
+		# PetFeeder publishes straight away, nothing is ever held
+		return None
+
+	def release(self, device):
+		pass
+
+
+class Scheduler:
+
+	def __init__(self, loop=None, fleet=None):
+		self.loop = loop or asyncio.get_event_loop()
+		self.fleet = fleet if fleet is not None else FeederFleet()
+		self.heap = []
+		self.seq = itertools.count()
+		self.generation = {}
+		# (device, kind) -> time of its live heap entry
+		self.deadline = {}
+		self.stale = 0
+		self.wakeup = asyncio.Event()
+		self.devices = []
+
+	def add_device(self, device):
+		self.fleet.attach(device, self)
+		self.devices.append(device)
+		# devices that report weight by exception are never polled
+		if(self.fleet.polled(device)):
+			self.set_deadline(device, POLL, time.time() + poll_interval)
+		self.reschedule(device)
+
+	def set_deadline(self, device, kind, when):
+		key = (device, kind)
+		last = self.deadline.get(key)
+		if(last is None and when is None):
+			return
+		if(last is not None and when is not None and abs(when - last) < deadline_slack):
+			return
+		gen = self.generation.get(key, 0) + 1
+		self.generation[key] = gen
+		if(last is not None):
+			self.stale += 1
+			if(self.stale > len(self.heap) // 2):
+				self.compact()
+		if(when is None):
+			del self.deadline[key]
+			return
+		self.deadline[key] = when
+		if(not self.heap or when < self.heap[0][0]):
+			self.wakeup.set()
+		heapq.heappush(self.heap, (when, next(self.seq), gen, kind, device))
+
+	def compact(self):
+		self.heap = [entry for entry in self.heap if self.generation.get((entry[4], entry[3])) == entry[2]]
+		heapq.heapify(self.heap)
+		self.stale = 0
+
+	def reschedule(self, device):
+		# May be called from the MQTT client thread
+		self.loop.call_soon_threadsafe(self._reschedule, device)
+
+	def _reschedule(self, device):
+		self.set_deadline(device, DISPENSE, self.fleet.next_dispense_deadline(device))
+		self.set_deadline(device, RETRANSMIT, self.fleet.next_retransmit_deadline(device))
+		self.set_deadline(device, WAKE, self.fleet.next_wake_deadline(device))
+
+	def fire(self, kind, device):
+		if(kind == DISPENSE):
+			if(self.fleet.is_dispense_time(device)):
+				print("Dispense time for {}!".format(self.fleet.name(device)))
+				self.fleet.dispense(device)
+			self._reschedule(device)
+		elif(kind == POLL):
+			print("Requesting information from {}".format(self.fleet.name(device)))
+			self.fleet.poll(device)
+			self.set_deadline(device, POLL, time.time() + poll_interval)
+			self._reschedule(device)
+		elif(kind == RETRANSMIT):
+			self.fleet.retransmit_expired(device)
+			self._reschedule(device)
+		elif(kind == WAKE):
+			self.fleet.release(device)
+			self._reschedule(device)
+
+	async def run(self):
+		while True:
+			now = time.time()
+			while(self.heap and self.heap[0][0] <= now):
+				(when, _, gen, kind, device) = heapq.heappop(self.heap)
+				if(self.generation.get((device, kind)) == gen):
+					del self.deadline[(device, kind)]
+					self.fire(kind, device)
+				else:
+					self.stale -= 1
+			self.wakeup.clear()
+			timeout = self.heap[0][0] - time.time() if self.heap else None
+			try:
+				await asyncio.wait_for(self.wakeup.wait(), timeout)
+			except asyncio.TimeoutError:
+				pass
+
+
+class SimulatedFeeder(petfeeder.PetFeeder):
+	# Acks every command on the event loop instead of talking to a broker
+
+	def aws_init(self, pub_topic=None, sub_topic=None):
+		self.pub_topic = pub_topic
+		self.sub_topic = sub_topic
+
+	def publish_msg(self, msg_json):
+		self.scheduler.loop.call_soon(self.handle_ack, {'id': msg_json['id'], 'result': 'done'})
+
+
+class LoopbackClient:
+	# Stands in for the shard's broker connection; acks every command
+
+	def __init__(self, loop):
+		self.loop = loop
+		self.registry = None
+
+	def publish(self, topic, payload, qos):
+		ack = {'ack': [{'id': json.loads(payload)['id'], 'result': 'done'}]}
+		self.loop.call_soon(self.registry.route, topic.replace('from_aws', 'to_aws'), json.dumps(ack))
+
+
+class BenchScheduler(Scheduler):
+
+	def __init__(self, loop=None, fleet=None):
+		Scheduler.__init__(self, loop, fleet)
+		self.lag = []
+		self.peak_heap = 0
+
+	def set_deadline(self, device, kind, when):
+		Scheduler.set_deadline(self, device, kind, when)
+		self.peak_heap = max(self.peak_heap, len(self.heap))
+
+	def fire(self, kind, device):
+		if(kind == DISPENSE):
+			deadline = self.fleet.next_dispense_deadline(device)
+			if(deadline is not None):
+				self.lag.append(time.time() - deadline)
+		Scheduler.fire(self, kind, device)
+
+
+def bench(num_devices, duration, use_registry, broker=None):
+	from datetime import datetime, timedelta
+	from pytz import timezone
+	import contextlib
+	import os
+	import resource
+	import registry
+
+	loop = asyncio.new_event_loop()
+	asyncio.set_event_loop(loop)
+	if(broker):
+		# The registry talks to the broker over MQTT and one more connection
+		# acks every command on behalf of all the feeders
+		fleet = registry.DeviceRegistry(registry.open_client('bench-scheduler', None, None, broker))
+		feeders = registry.open_client('bench-feeders', None, None, broker)
+		feeders.connect()
+		feeders.subscribe(registry.device_topic('+', 'from_aws'), 1, lambda client, userdata, message: client.publish(
+			message.topic.replace('from_aws', 'to_aws'), json.dumps({'ack': [{'id': json.loads(message.payload)['id'], 'result': 'done'}]}), 1))
+	elif(use_registry):
+		client = LoopbackClient(loop)
+		fleet = client.registry = registry.DeviceRegistry(client)
+	else:
+		fleet = FeederFleet()
+	sched = BenchScheduler(loop, fleet)
+	start = datetime.now().astimezone(timezone('utc'))
+	for n in range(num_devices):
+		first = start + timedelta(seconds=1 + (duration - 2) * n / num_devices)
+		times = [first, first + timedelta(hours=12)]
+		if(use_registry or broker):
+			sched.add_device(fleet.add(n, times))
+		else:
+			dev = SimulatedFeeder(serial_num=n, dispense_times=times)
+			dev.aws_init()
+			sched.add_device(dev)
+	if(broker):
+		fleet.client.connect()
+		fleet.subscribe()
+	cpu = time.process_time()
+	with open(os.devnull, 'w') as devnull, contextlib.redirect_stdout(devnull):
+		try:
+			loop.run_until_complete(asyncio.wait_for(sched.run(), duration))
+		except asyncio.TimeoutError:
+			pass
+	cpu = time.process_time() - cpu
+	lag = sorted(sched.lag)
+	print("{} devices, {} dispenses in {} s, cpu {:.2f} s".format(num_devices, len(lag), duration, cpu))
+	if(use_registry or broker):
+		print("{} commands unacked, {} retransmits".format(sum(len(pending) for pending in fleet.in_flight.values()), fleet.retransmits))
+	if(lag):
+		print("dispatch lag p50 {:.1f} ms  p99 {:.1f} ms  max {:.1f} ms".format(lag[len(lag) // 2] * 1e3, lag[int(len(lag) * 0.99)] * 1e3, lag[-1] * 1e3))
+	print("heap entries peak {}, at the end {}".format(sched.peak_heap, len(sched.heap)))
+	print("max rss {} kB".format(resource.getrusage(resource.RUSAGE_SELF).ru_maxrss))
+
+
+if(__name__ == "__main__"):
+	import argparse
+	parser = argparse.ArgumentParser(description="Benchmark the scheduler against simulated feeders")
+	parser.add_argument('-n', '--devices', type=int, default=10000)
+	parser.add_argument('-t', '--duration', type=int, default=30)
+	parser.add_argument('-r', '--registry', action='store_true', help="keep device state in a DeviceRegistry")
+	parser.add_argument('-p', '--poll', type=float, default=poll_interval, help="seconds between weight polls")
+	parser.add_argument('-b', '--broker', help="host:port of a local MQTT broker to send commands and acks through")
+	args = parser.parse_args()
+	poll_interval = args.poll
+	bench(args.devices, args.duration, args.registry, args.broker)
@@ -1,29 +1,19 @@
 #!/usr/bin/env python3
 
+import asyncio
 import petfeeder
-from datetime import datetime, timedelta
-from pytz import timezone
+from scheduler import Scheduler
 
 
-device_list = None
+device_list = []
 
 
-while True:
-    t = datetime.now().astimezone(timezone('utc'))
-    if(devlice_list == None):
+if(__name__ == "__main__"):
+    loop = asyncio.new_event_loop()
+    asyncio.set_event_loop(loop)
+    sched = Scheduler(loop)
+    if(not device_list):
         print("No devices in the device_list.")
-    else:
-        for device in device_list:
-            if(device.is_dispense_time()):
-                print("{}: Dipsense time for {}@{}.".format(datetime.now().astimezone(t, device.serial_num, device.ip_addr))
-                json_string = "{\"request\":[\"dispense\",\"weight\"]}"
-                data = json.loads(json_string)
-                print("String: {}".format(json_string))
-                print("JSON: {}".format(json.dumps(data, sort_keys=True, indent=4)))
-                uut.publish_msg(data)
-        elif(delta.total_seconds() >= 60):
-            print("Requesting information from pet-feeder")
-            prev = datetime.now().astimezone(timezone('utc'))
-            json_string = "{\"request\":[\"weight\"]}"
-            data = json.loads(json_string)
-            uut.publish_msg(data)
+    for device in device_list:
+        sched.add_device(device)
+    loop.run_until_complete(sched.run())
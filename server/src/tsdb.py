@@ -0,0 +1,269 @@
+#!/usr/bin/env python3
+
+"""
+Append-only time-series store for per-device telemetry.
+
+Layout: <root>/<device>/<metric>/<YYYYMMDD>.seg, one segment per UTC day.
+A segment is a sequence of blocks. Each block has a fixed header followed by
+zigzag varints: timestamps as delta-of-delta (regular sampling encodes to one
+byte per point) and values as deltas of a fixed-point integer. Points are
+buffered per series and day and written a block at a time; readers mmap
+segments and skip blocks by their time range without decoding them.
+
+Points can arrive late: journal uploads, events back-dated by their age and
+gateway batches. A buffer is sorted before it is written, so a block's first
+time is also its lowest, and scans return points in time order even when
+blocks of a segment overlap.
+"""
+
+from array import array
+import calendar
+import mmap
+import os
+import struct
+import threading
+import time
+
+BLOCK_MAGIC = b'TSB1'
+# magic, count, first and lowest time (ms), highest time (ms), first value, payload length
+BLOCK_HEADER = struct.Struct('<4sHqqqI')
+BLOCK_POINTS = 512
+DAY_MS = 86400 * 1000
+
+# Fixed-point scale per metric; values are stored as round(value * scale)
+SCALES = {'weight': 10, 'dispense': 10, 'motion': 1, 'bout': 10, 'bout_s': 1, 'bout_rate': 10, 'motion_latency': 1, 'clock_drift': 1, 'eaten': 10}
+
+
+def _zigzag(n):
+	return (n << 1) ^ (n >> 63)
+
+
+def _put_varint(out, n):
+	n = _zigzag(n)
+	while n >= 0x80:
+		out.append((n & 0x7f) | 0x80)
+		n >>= 7
+	out.append(n)
+
+
+def encode_block(times, values):
+	out = bytearray()
+	prev_t = times[0]
+	prev_delta = 0
+	prev_v = values[0]
+	for i in range(1, len(times)):
+		delta = times[i] - prev_t
+		_put_varint(out, delta - prev_delta)
+		_put_varint(out, values[i] - prev_v)
+		prev_t = times[i]
+		prev_delta = delta
+		prev_v = values[i]
+	return BLOCK_HEADER.pack(BLOCK_MAGIC, len(times), times[0], times[-1], values[0], len(out)) + out
+
+
+def decode_block(buf, offset, count, t0, v0, times, values):
+	t = t0
+	delta = 0
+	v = v0
+	times.append(t)
+	values.append(v)
+	for _ in range(count - 1):
+		for field in range(2):
+			n = 0
+			shift = 0
+			while True:
+				b = buf[offset]
+				offset += 1
+				n |= (b & 0x7f) << shift
+				if(b < 0x80):
+					break
+				shift += 7
+			n = (n >> 1) ^ -(n & 1)
+			if(field == 0):
+				delta += n
+				t += delta
+			else:
+				v += n
+		times.append(t)
+		values.append(v)
+
+
+class Series:
+
+	def __init__(self, path, scale):
+		self.path = path
+		self.scale = scale
+		# UTC day -> ([time], [value]) not written yet
+		self.days = {}
+
+
+class TimeSeriesStore:
+
+	def __init__(self, root):
+		self.root = root
+		self.series = {}
+		# write() runs on a worker thread while appends fill new blocks
+		self.lock = threading.Lock()
+
+	def _series(self, device, metric):
+		key = (device, metric)
+		s = self.series.get(key)
+		if(s is None):
+			path = os.path.join(self.root, str(device), metric)
+			os.makedirs(path, exist_ok=True)
+			s = self.series[key] = Series(path, SCALES.get(metric, 1000))
+		return s
+
+	def append(self, device, metric, t, value):
+		# t is epoch seconds, in any order
+		s = self._series(device, metric)
+		t_ms = int(t * 1000)
+		day = t_ms // DAY_MS
+		buf = s.days.get(day)
+		if(buf is None):
+			buf = s.days[day] = ([], [])
+		buf[0].append(t_ms)
+		buf[1].append(int(round(value * s.scale)))
+		if(len(buf[0]) >= BLOCK_POINTS):
+			del s.days[day]
+			self.write([(s.path, day, buf[0], buf[1])])
+
+	def take(self):
+		"""Hands over every buffered point as blocks for write()."""
+		blocks = []
+		for s in self.series.values():
+			for (day, (times, values)) in s.days.items():
+				blocks.append((s.path, day, times, values))
+			s.days = {}
+		return blocks
+
+	def write(self, blocks):
+		# Encoding and file I/O only, so it can run off the event loop
+		for (path, day, times, values) in blocks:
+			if(any(a > b for (a, b) in zip(times, times[1:]))):
+				points = sorted(zip(times, values))
+				times = [t for (t, _) in points]
+				values = [v for (_, v) in points]
+			block = encode_block(times, values)
+			name = time.strftime('%Y%m%d', time.gmtime(day * 86400)) + '.seg'
+			with self.lock, open(os.path.join(path, name), 'ab') as f:
+				f.write(block)
+
+	def flush(self):
+		self.write(self.take())
+
+	def close(self):
+		self.flush()
+
+	def devices(self):
+		return sorted(os.listdir(self.root)) if os.path.isdir(self.root) else []
+
+	def scan(self, device, metric, start=None, end=None):
+		"""Points of one series with start <= t < end (epoch seconds).
+
+		Returns (times, values) as array('d') in time order, times in epoch
+		seconds. Points still buffered in memory are included.
+		"""
+		scale = SCALES.get(metric, 1000)
+		lo = int(start * 1000) if start is not None else -(1 << 62)
+		hi = int(end * 1000) if end is not None else 1 << 62
+		raw_t = array('q')
+		raw_v = array('q')
+		path = os.path.join(self.root, str(device), metric)
+		if(os.path.isdir(path)):
+			for name in sorted(os.listdir(path)):
+				day_ms = calendar.timegm(time.strptime(name[:8], '%Y%m%d')) * 1000
+				if(day_ms + DAY_MS <= lo or day_ms >= hi):
+					continue
+				self._scan_segment(os.path.join(path, name), lo, hi, raw_t, raw_v)
+		s = self.series.get((device, metric))
+		if(s is not None):
+			for (times, values) in list(s.days.values()):
+				for (t, v) in zip(times, values):
+					if(lo <= t < hi):
+						raw_t.append(t)
+						raw_v.append(v)
+		if(any(a > b for (a, b) in zip(raw_t, raw_t[1:]))):
+			order = sorted(range(len(raw_t)), key=raw_t.__getitem__)
+			raw_t = array('q', (raw_t[i] for i in order))
+			raw_v = array('q', (raw_v[i] for i in order))
+		return (array('d', (t / 1000.0 for t in raw_t)), array('d', (v / scale for v in raw_v)))
+
+	def _scan_segment(self, path, lo, hi, out_t, out_v):
+		with open(path, 'rb') as f:
+			if(os.fstat(f.fileno()).st_size == 0):
+				return
+			buf = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+		try:
+			offset = 0
+			while offset + BLOCK_HEADER.size <= len(buf):
+				(magic, count, t0, t1, v0, length) = BLOCK_HEADER.unpack_from(buf, offset)
+				if(magic != BLOCK_MAGIC):
+					# torn write at the tail of the segment
+					break
+				body = offset + BLOCK_HEADER.size
+				offset = body + length
+				if(offset > len(buf)):
+					# block still being written
+					break
+				if(t1 < lo or t0 >= hi):
+					continue
+				if(lo <= t0 and t1 < hi):
+					decode_block(buf, body, count, t0, v0, out_t, out_v)
+				else:
+					times = array('q')
+					values = array('q')
+					decode_block(buf, body, count, t0, v0, times, values)
+					for (t, v) in zip(times, values):
+						if(lo <= t < hi):
+							out_t.append(t)
+							out_v.append(v)
+		finally:
+			buf.close()
+
+
+def bench(root, num_devices, points, interval):
+	import random
+	store = TimeSeriesStore(root)
+	start = time.time() - points * interval
+	weights = [random.uniform(0, 200) for _ in range(num_devices)]
+	cpu = time.perf_counter()
+	for i in range(points):
+		t = start + i * interval
+		for dev in range(num_devices):
+			weights[dev] = max(0.0, weights[dev] + random.uniform(-1, 1))
+			store.append(dev, 'weight', t, weights[dev])
+	store.close()
+	ingest = time.perf_counter() - cpu
+	total = num_devices * points
+	size = sum(os.path.getsize(os.path.join(d, f)) for (d, _, files) in os.walk(root) for f in files)
+	print("ingest: {} points in {:.2f} s, {:.0f} points/s, {:.2f} bytes/point".format(total, ingest, total / ingest, size / total))
+
+	cpu = time.perf_counter()
+	scanned = 0
+	for dev in range(num_devices):
+		(times, values) = store.scan(dev, 'weight')
+		scanned += len(times)
+	full = time.perf_counter() - cpu
+	print("full scan: {} points in {:.2f} s, {:.0f} points/s".format(scanned, full, scanned / full))
+
+	cpu = time.perf_counter()
+	hour = start + points * interval - 3600
+	scanned = 0
+	for dev in range(num_devices):
+		(times, values) = store.scan(dev, 'weight', hour)
+		scanned += len(times)
+	recent = time.perf_counter() - cpu
+	print("last-hour scan: {} points from {} devices in {:.3f} s".format(scanned, num_devices, recent))
+
+
+if(__name__ == "__main__"):
+	import argparse
+	import tempfile
+	parser = argparse.ArgumentParser(description="Benchmark the telemetry store")
+	parser.add_argument('-n', '--devices', type=int, default=1000)
+	parser.add_argument('-p', '--points', type=int, default=1440)
+	parser.add_argument('-i', '--interval', type=float, default=60)
+	args = parser.parse_args()
+	with tempfile.TemporaryDirectory() as root:
+		bench(root, args.devices, args.points, args.interval)